@@ -5,49 +5,247 @@ The firmware component consists of a simple executable that looks for a list of
 at a known location in flash and then programs them into the modem side of the nRF91 SoC. The
 block of credential information starts at the first flash page boundary following the firmware
 stub and consists of the following:
-[MAGIC_NUMBER (4 bytes)][FW_RESULT_CODE (4 bytes)][IMEI (16 bytes)][CRED_COUNT (1 byte)]
+[MAGIC_NUMBER (4 bytes)][FW_RESULT_CODE (4 bytes)][IMEI (16 bytes)][CRED_DIGEST (4 bytes)]
+    [MAILBOX_ADDR (4 bytes)][RECORDS_LEN (4 bytes)][MODE (1 byte)]
     [SEC_TAG (4 bytes)][CRED_TYPE (1 byte)][CRED_LEN (2 bytes)][CRED_DATA (N bytes)]
     ...
     [SEC_TAG (4 bytes)][CRED_TYPE (1 byte)][CRED_LEN (2 bytes)][CRED_DATA (N bytes)]
 
+The firmware finds the block through its locator, [LOCATOR_MAGIC (4 bytes)][PAGE_ADDR (4 bytes)]
+in its read-only data, which is patched with the block's address before programming. The block is
+built at CRED_PAGE_ADDR on its own and only moved when it's merged with the stub (see
+FlashStubProbe), so the rest of this script doesn't need to know where it ends up. A stub without
+a locator predates this layout (it expects a CRED_COUNT byte where CRED_DIGEST is now) and is
+rejected rather than left to time out.
+
+RECORDS_LEN is the number of bytes of credential records that follow MODE. The firmware writes
+records until it reaches that length, so there is no limit on the number of credentials other
+than the size of flash.
+
 IMEIs are only 15 chars long but the buffer is padded with an additional byte to mantain
 address alignment.
 
+CRED_DIGEST is a CRC32 of the credential records that the firmware writes after it has
+successfully written them to the modem. In MODE_CHECK the firmware writes nothing to the modem
+and instead stores the AT%CMNG=1 listing where the first credential would otherwise be. This
+allows boards that already hold the requested credentials to be skipped (see --check).
+
+MAILBOX_ADDR is written by the firmware as soon as it starts and points to a small struct in RAM:
+[MAILBOX_MAGIC (4 bytes)][IMEI (16 bytes)][CFUN_MS (4 bytes)][CFUN_MODE (1 byte)]
+    [CFUN_CHANGED (1 byte)][CRED_WRITTEN (2 bytes)][CRED_MS (4 bytes)][CRED_BATCHED (1 byte)]
+    [PADDING (3 bytes)][CHANNEL_ADDR (4 bytes)][BOOT_MS (4 bytes)]
+The IMEI is published there as soon as the modem returns it. In MODE_IMEI this is all that the
+firmware does so --imei_only can poll for it instead of waiting for the full credential cycle.
+The CFUN fields record the modem's functional mode at startup, whether the firmware had to power
+it off, and how long that took. The CRED fields record how many credentials were written, how
+long it took, and whether they were written one at a time via modem_key_mgmt or back-to-back
+through one AT socket (see --batch). BOOT_MS is the kernel's uptime when the firmware sent its
+first AT command, so stub changes that slow down booting show up in --log. It starts when the
+kernel does and so leaves out the bootloader and the secure partition manager.
+
+Failures are retried up to --retries times before giving up. A probe transaction that fails is
+repeated on its own, a firmware that doesn't write a result in time is reset and polled again,
+and a failed modem write is followed by a new hex file that holds only the credentials from
+CRED_WRITTEN onwards, since the firmware stops at the first one that fails.
+
+With --history the time that the firmware took to write each set of credentials is recorded
+against its profile (mode, record count, and record bytes). Later runs with the same profile
+start polling shortly before the fastest recorded time and give up a margin after the slowest
+instead of waiting for the fixed --fw_delay.
+
+With --transport rtt nothing but the firmware stub goes through flash. The firmware runs in
+MODE_STREAM and publishes CHANNEL_ADDR in the mailbox, pointing to a ring buffer channel with the
+same layout as a SEGGER RTT control block. The records are streamed into its down buffer over
+SWD, ended by a record with a sec_tag of 0xFFFFFFFF, and the firmware writes each one to the
+modem as it arrives. The result of each record ("%CRED: <index>,<result>"), the firmware's
+printk output, and finally "%DONE: <result>,<count>,<crc32>" come back on the up buffer. Only
+the records that failed are streamed again on a retry.
+
+With --transport uart the same records are sent over the device's UART_0 (see --port) in
+MODE_UART instead, for fixtures where SWD is shared or slow. Once it has switched the UART to
+--baudrate the firmware sends "%READY: <bytes>" with the size of its receive buffer. Each
+record is framed as [LEN (2 bytes)][RECORD][CRC32 of RECORD (4 bytes)] and no more than that
+many bytes are kept in flight past the first record that hasn't been answered. The per-record
+CRC replaces the CRC of the whole stream, and a corrupted record is answered with -EBADMSG and
+sent again on a retry like any other failure.
+
+With --delta, --program_app leaves the rest of flash alone. The stub and the credential page are
+programmed with ERASE_SECTOR instead of ERASE_ALL and, once the credentials are written, the
+firmware runs once more in MODE_HASH, which writes a CRC32 of every non-secure flash page where
+the first credential would otherwise be. Only the pages of the application whose CRC32 doesn't
+match, any other pages that aren't blank, the secure pages below the stub (which the firmware
+can't read), and the pages that the stub and the credential page took are then erased and
+programmed, along with the UICR (ERASE_SECTOR_AND_UICR) if the application has anything there.
+Reworking a board that already runs the same application then takes a fraction of the time.
+
+With --keygen the client private key never leaves the device. The firmware runs in MODE_KEYGEN,
+where the only record names the sec_tag of the key and has no content. The modem generates the
+key (AT%KEYGEN) and the firmware writes its PKCS#10 CSR, base64url encoded, right after that
+record and then carries on as in MODE_STREAM. The CSR is signed with openssl by the local CA given
+with --signing_cert and --signing_key, and the client certificate is streamed along with the other
+credentials in the same boot.
+
+Every "{IMEI}" in a credential is replaced with the device's IMEI by the firmware before it is
+written to the modem, so credentials derived from the IMEI (e.g. --psk_ident nrf-{IMEI}) don't
+need an --imei_only run first. The records, and so CRED_DIGEST, keep the placeholder.
+
+When it has finished, successfully or not, the firmware executes a breakpoint if a debugger is
+attached. With --wait halt the core's halted state (S_HALT in DHCSR) is polled instead of the
+result code, so a firmware that gives up without writing a result is detected straight away.
+
 NOTE: Does not parse existing credentials when reading from an in_file so there is no
       check to prevent adding duplicate credentials.
 """
 import sys
 import os
 import argparse
+import base64
+import binascii
+import collections
+import contextlib
+import datetime
+import functools
+import hashlib
+import json
+import re
 import struct
+import subprocess
 import tempfile
 import time
+import zlib
 
-from intelhex import IntelHex
-from pynrfjprog import HighLevel
+try:
+    from pynrfjprog import HighLevel
+except ImportError:
+    # Only required when using a J-Link (see --probe).
+    HighLevel = None
+try:
+    import serial
+except ImportError:
+    # Only required for --transport uart.
+    serial = None
 
 
 DEFAULT_CRED_WRITE_TIME_S = 7
+DEFAULT_CRED_CHECK_TIME_S = 3
+DEFAULT_HASH_TIME_S = 3
+POLL_INTERVAL_S = 0.05
+DEFAULT_RETRIES = 2
+
+# Only the most recent samples of each profile are kept in the history file.
+HISTORY_SAMPLES = 20
+HISTORY_MARGIN = 1.25
+HISTORY_MARGIN_S = 0.5
+HISTORY_START = 0.8
 
 HEX_PATH = os.path.sep.join(("build", "zephyr", "merged.hex"))
 TMP_FILE_NAME = "cred_hex.hex"
 MAGIC_NUMBER_BYTES = struct.pack('I', 0xca5cad1a)
 BLANK_FW_RESULT_CODE = 0xFFFFFFFF
 BLANK_FLASH_VALUE = 0xFF
+BLANK_FLASH_WORD = 0xFFFFFFFF
 
 CRED_PAGE_ADDR = 0x2B000
+FLASH_PAGE_SIZE = 0x1000
+FLASH_END_ADDR = 0x100000
+FLASH_PAGES = (FLASH_END_ADDR // FLASH_PAGE_SIZE)
+LOCATOR_MAGIC_BYTES = struct.pack('<I', 0x45474150)
+LOCATOR_LEN = 8
 FW_RESULT_CODE_ADDR = (CRED_PAGE_ADDR + 4)
 IMEI_ADDR = (FW_RESULT_CODE_ADDR + 4)
-CRED_COUNT_ADDR = (IMEI_ADDR + 16)
-FIRST_CRED_ADDR = (CRED_COUNT_ADDR + 1)
+CRED_DIGEST_ADDR = (IMEI_ADDR + 16)
+MAILBOX_ADDR_ADDR = (CRED_DIGEST_ADDR + 4)
+RECORDS_LEN_ADDR = (MAILBOX_ADDR_ADDR + 4)
+MODE_ADDR = (RECORDS_LEN_ADDR + 4)
+FIRST_CRED_ADDR = (MODE_ADDR + 1)
+CHECK_LIST_ADDR = FIRST_CRED_ADDR
+PAGE_HASHES_ADDR = FIRST_CRED_ADDR
+# The address of the first hashed page followed by a CRC32 of each page up to FLASH_END_ADDR.
+PAGE_HASHES_LEN = (4 + FLASH_PAGES * 4)
+CSR_ADDR = (FIRST_CRED_ADDR + 7)
+MAX_CSR_LEN_BYTES = 2048
+
+MODE_WRITE = 0x00
+MODE_CHECK = 0x01
+MODE_IMEI = 0x02
+MODE_WRITE_BATCHED = 0x03
+MODE_STREAM = 0x04
+MODE_UART = 0x05
+MODE_HASH = 0x06
+MODE_KEYGEN = 0x07
+MODE_WRITE_FRAGMENTED = 0x08
+
+DHCSR_ADDR = 0xE000EDF0
+DHCSR_S_HALT = (1 << 17)
+
+# Erase actions for programming, named after pynrfjprog's HighLevel.EraseAction.
+ERASE_ALL = "ERASE_ALL"
+ERASE_SECTOR = "ERASE_SECTOR"
+ERASE_SECTOR_AND_UICR = "ERASE_SECTOR_AND_UICR"
+
+WAIT_POLL = "poll"
+WAIT_HALT = "halt"
+
+TRANSPORT_FLASH = "flash"
+TRANSPORT_RTT = "rtt"
+TRANSPORT_UART = "uart"
+
+DEFAULT_BAUDRATE = 1000000
+FRAME_HEADER_FORMAT = '<H'
+FRAME_CRC_FORMAT = '<I'
+
+# SEGGER RTT control block with one up and one down buffer descriptor.
+CHANNEL_ID = b"SEGGER RTT"
+CHANNEL_UP_OFFSET = 24
+CHANNEL_DOWN_OFFSET = (CHANNEL_UP_OFFSET + 24)
+CHANNEL_LEN = (CHANNEL_DOWN_OFFSET + 24)
+RING_WR_OFF_OFFSET = 12
+RING_RD_OFF_OFFSET = 16
+STREAM_END_RECORD = struct.pack('<IBH', 0xFFFFFFFF, 0xFF, 0)
+STREAM_CRED_PATTERN = re.compile(r'^%CRED: (\d+),(-?\d+)$')
+STREAM_DONE_PATTERN = re.compile(r'^%DONE: (-?\d+),(\d+),(\d+)$')
+STREAM_READY_PATTERN = re.compile(r'^%READY: (\d+)$')
+
+MAILBOX_MAGIC = 0x4D41494C
+MAILBOX_IMEI_OFFSET = 4
+MAILBOX_CFUN_OFFSET = (MAILBOX_IMEI_OFFSET + 16)
+MAILBOX_LEN = (MAILBOX_CFUN_OFFSET + 24)
+
+# Matches the lines returned by AT%CMNG=1, e.g. '%CMNG: 1234,0,"<SHA-256 of the content>"'
+CRED_LIST_PATTERN = re.compile(r'%CMNG:\s*(\d+),\s*(\d+)(?:,\s*"([0-9A-Fa-f]*)")?')
+MAX_CRED_LIST_LEN_BYTES = 4096
 
 IMEI_LEN = 15
+# Replaced with the device's IMEI by the firmware wherever it appears in a credential.
+IMEI_PLACEHOLDER = b"{IMEI}"
+
+# Used to sign the CSRs from --keygen with the local CA.
+OPENSSL = "openssl"
+CERT_DAYS = 365
+CSR_PEM_LABEL = "CERTIFICATE REQUEST"
+CERT_PEM_BEGIN = b"-----BEGIN CERTIFICATE-----"
 
 # For more information: https://tools.ietf.org/html/rfc4279
 MAX_PSK_IDENT_LEN_BYTES = 128
 MAX_PSK_LEN_BYTES = 64
 MAX_KEY_MATERIAL_LEN_BYTES = 4077 # Appears to be the case as of modem firmware 1.1.0
 
+# See https://tools.ietf.org/html/rfc7468
+PEM_BEGIN_PATTERN = re.compile(r'^-----BEGIN ([A-Z0-9 ]*)-----$')
+PEM_BEGIN_FORMAT = "-----BEGIN {}-----"
+PEM_END_FORMAT = "-----END {}-----"
+PEM_HEADER_PATTERN = re.compile(r'^[A-Za-z0-9-]+:')
+
+# Key material is cached by content so that files referenced repeatedly by an in-process caller
+# (e.g. one _build_hex() per device) are only read and validated once. Paths map to the SHA-256
+# of their validated content as long as the file doesn't change, and equal content is stored
+# once whichever path it came from. The caches hold secrets so only the most recently used
+# entries are kept.
+KEY_MATERIAL_CACHE_SIZE = 16
+CRED_RECORD_CACHE_SIZE = 64
+_key_material_digests = collections.OrderedDict()
+_key_material = collections.OrderedDict()
+
 CRED_TYPE_ROOT_CA = 0
 CRED_TYPE_CLIENT_CERT = 1
 CRED_TYPE_CLIENT_PRIVATE_KEY = 2
@@ -55,101 +253,868 @@ CRED_TYPE_PSK = 3
 CRED_TYPE_PSK_IDENTITY = 4
 
 
-def _write_firmware(nrfjprog_probe, fw_hex):
-    """Program and verify a hex file."""
-    program_options = HighLevel.ProgramOptions(
-        erase_action=HighLevel.EraseAction.ERASE_ALL,
-        reset=HighLevel.ResetAction.RESET_SYSTEM,
-        verify=HighLevel.VerifyAction.VERIFY_READ)
-    nrfjprog_probe.program(fw_hex, program_options)
+class CredError(Exception):
+    """An error that ends the run with a specific exit status."""
+
+    def __init__(self, message, status):
+        Exception.__init__(self, message)
+        self.status = status
+
+
+class PhaseTimer(object):
+    """Accumulate the wall time spent in each phase of a run."""
+
+    def __init__(self):
+        self.phases = collections.OrderedDict()
+
+    @contextlib.contextmanager
+    def phase(self, name):
+        """Context manager that adds the time spent inside it to the named phase."""
+        start = time.monotonic()
+        try:
+            yield
+        finally:
+            self.phases[name] = self.phases.get(name, 0.0) + (time.monotonic() - start)
+
+
+class HexImage(object):
+    """An Intel HEX image held as a sorted list of contiguous [start, bytearray] segments.
+
+    The intelhex module keeps a dict entry per byte, which is slow and large for the prebuilt
+    firmware and multi-hundred-KB --program_app images. This has the subset of its interface
+    that this script uses (segments, tobinstr, gets, puts, slicing, tofile) and is used for
+    every hex file, including the credential page. Start address records are ignored since
+    nothing here runs a hex file from its entry point.
+    """
+
+    def __init__(self):
+        self._segments = []
+
+    @classmethod
+    def load(cls, path):
+        """Parse a hex file, appending each data record to the segment that it continues."""
+        image = cls()
+        chunks = []
+        base = 0
+        with open(path) as hex_file:
+            for number, line in enumerate(hex_file, 1):
+                line = line.strip()
+                if not line:
+                    continue
+                try:
+                    record = bytes.fromhex(line[1:])
+                except ValueError:
+                    record = b''
+                if (line[0] != ':' or len(record) < 5 or len(record) != record[0] + 5 or
+                        sum(record) & 0xFF):
+                    raise CredError("Invalid hex record on line {} of {}".format(number, path),
+                                    -1)
+                record_type = record[3]
+                if record_type == 0:
+                    addr = base + (record[1] << 8 | record[2])
+                    if chunks and chunks[-1][0] + len(chunks[-1][1]) == addr:
+                        chunks[-1][1].extend(record[4:-1])
+                    else:
+                        chunks.append([addr, bytearray(record[4:-1])])
+                elif record_type == 1:
+                    break
+                elif record_type == 2:
+                    base = (record[4] << 8 | record[5]) << 4
+                elif record_type == 4:
+                    base = (record[4] << 8 | record[5]) << 16
+        # Records are almost always in order, so this only merges when they aren't.
+        for addr, data in sorted(chunks, key=lambda chunk: chunk[0]):
+            if image._segments and image._segments[-1][0] + len(image._segments[-1][1]) == addr:
+                image._segments[-1][1].extend(data)
+            else:
+                image.puts(addr, data)
+        return image
+
+    def segments(self):
+        """Return the (start, end) of each contiguous segment, end exclusive."""
+        return [(start, start + len(data)) for start, data in self._segments]
+
+    def minaddr(self):
+        """Return the lowest address or None if the image is empty."""
+        return self._segments[0][0] if self._segments else None
+
+    def maxaddr(self):
+        """Return the highest address or None if the image is empty."""
+        if not self._segments:
+            return None
+        return self._segments[-1][0] + len(self._segments[-1][1]) - 1
+
+    def __len__(self):
+        return sum(len(data) for _, data in self._segments)
+
+    def tobinstr(self, start=None, end=None):
+        """Return the bytes from start to end inclusive with gaps filled with the erased value."""
+        start = self.minaddr() if start is None else start
+        end = self.maxaddr() if end is None else end
+        if start is None or end < start:
+            return b''
+        out = bytearray([BLANK_FLASH_VALUE]) * (end + 1 - start)
+        for seg_start, data in self._segments:
+            first = max(start, seg_start)
+            last = min(end + 1, seg_start + len(data))
+            if first < last:
+                out[first - start:last - start] = data[first - seg_start:last - seg_start]
+        return bytes(out)
+
+    def gets(self, addr, length):
+        """Return length bytes from addr, which must all be in the same segment."""
+        for start, data in self._segments:
+            if start <= addr and addr + length <= start + len(data):
+                return bytes(data[addr - start:addr - start + length])
+        raise ValueError("Not enough data at 0x{:X} to read {} bytes".format(addr, length))
+
+    def puts(self, addr, data):
+        """Write data at addr, merging it with any segments that it overlaps or touches."""
+        end = addr + len(data)
+        keep = []
+        merge = []
+        for segment in self._segments:
+            if segment[0] + len(segment[1]) < addr or segment[0] > end:
+                keep.append(segment)
+            else:
+                merge.append(segment)
+        start = min([addr] + [seg_start for seg_start, _ in merge])
+        stop = max([end] + [seg_start + len(seg_data) for seg_start, seg_data in merge])
+        buf = bytearray(stop - start)
+        for seg_start, seg_data in merge:
+            buf[seg_start - start:seg_start - start + len(seg_data)] = seg_data
+        buf[addr - start:end - start] = data
+        keep.append([start, buf])
+        keep.sort(key=lambda segment: segment[0])
+        self._segments = keep
+
+    def __getitem__(self, key):
+        if not isinstance(key, slice):
+            return self.tobinstr(key, key)[0]
+        start = -1 if key.start is None else key.start
+        stop = (self.maxaddr() or 0) + 1 if key.stop is None else key.stop
+        image = HexImage()
+        for seg_start, data in self._segments:
+            first = max(start, seg_start)
+            last = min(stop, seg_start + len(data))
+            if first < last:
+                image._segments.append([first, data[first - seg_start:last - seg_start]])
+        return image
+
+    def __setitem__(self, addr, value):
+        self.puts(addr, bytes([value]))
+
+    def tofile(self, fobj, format="hex"):
+        """Write the image as a hex file with 16 byte data records to a path or file object."""
+        lines = []
+        upper = None
+        for start, data in self._segments:
+            offset = 0
+            while offset < len(data):
+                addr = start + offset
+                if addr >> 16 != upper:
+                    upper = addr >> 16
+                    lines.append(self._record(0, 4, struct.pack('>H', upper)))
+                count = min(16, len(data) - offset, 0x10000 - (addr & 0xFFFF))
+                lines.append(self._record(addr & 0xFFFF, 0, data[offset:offset + count]))
+                offset = offset + count
+        lines.append(self._record(0, 1, b''))
+        text = "\n".join(lines) + "\n"
+        if hasattr(fobj, "write"):
+            fobj.write(text)
+        else:
+            with open(fobj, 'w') as hex_file:
+                hex_file.write(text)
+
+    @staticmethod
+    def _record(addr, record_type, data):
+        """Return one hex record as a line."""
+        record = struct.pack('>BHB', len(data), addr, record_type) + bytes(data)
+        return ":" + record.hex().upper() + "{:02X}".format(-sum(record) & 0xFF)
+
+
+class JLinkProbe(object):
+    """Debug probe backend that uses a J-Link via pynrfjprog.
+
+    Other backends (see cred_mock.MockProbe) implement the same methods:
+        program(hex_path, erase=ERASE_ALL)
+                                erase everything (or only the pages in the hex file, and the
+                                UICR with ERASE_SECTOR_AND_UICR), then program, verify, and
+                                reset
+        read(addr)              read a word and return it as an int
+        read(addr, length)      read length bytes
+        write(addr, data)       write bytes to RAM
+    Reads must also work for the core's debug registers (e.g. DHCSR).
+        erase_all()             erase everything
+        reset()                 reset the device and let it run
+        close()                 release the probe
+    A backend may also have a uart_port attribute naming the serial port that is connected to
+    the device's UART_0, which is used by --transport uart when --port isn't given.
+    """
+
+    def __init__(self, api, serial_number):
+        self._api = api
+        self.serial_number = serial_number
+        self._probe = HighLevel.DebugProbe(api, serial_number,
+                                           HighLevel.CoProcessor.CP_APPLICATION)
+
+    def program(self, hex_path, erase=ERASE_ALL):
+        """Program and verify a hex file."""
+        program_options = HighLevel.ProgramOptions(
+            erase_action=getattr(HighLevel.EraseAction, erase),
+            reset=HighLevel.ResetAction.RESET_SYSTEM,
+            verify=HighLevel.VerifyAction.VERIFY_READ)
+        self._probe.program(hex_path, program_options)
+
+    def read(self, addr, length=None):
+        """Read a word as an int or a number of bytes."""
+        if length is None:
+            return self._probe.read(addr)
+        return self._probe.read(addr, length)
+
+    def write(self, addr, data):
+        """Write bytes to RAM."""
+        self._probe.write(addr, list(data))
+
+    def erase_all(self):
+        """Erase all of the flash."""
+        self._probe.erase(HighLevel.EraseAction.ERASE_ALL)
+
+    def reset(self):
+        """Reset the device and let it run."""
+        self._probe.reset()
+
+    def close(self):
+        """Close the nrfjprog connection."""
+        self._api.close()
+
+
+class RetryingProbe(object):
+    """Wrap a probe backend and repeat any transaction that fails, up to a number of retries.
+
+    The retries are counted in report["retries"].
+    """
+
+    def __init__(self, probe, retries, report):
+        self._probe = probe
+        self._retries = retries
+        self._report = report
+        self.serial_number = probe.serial_number
+        self.uart_port = getattr(probe, "uart_port", None)
+
+    def _retry(self, name, func, *args):
+        """Call func until it succeeds or the retries run out."""
+        attempt = 0
+        while True:
+            try:
+                return func(*args)
+            except Exception as ex:
+                if attempt >= self._retries:
+                    raise
+                attempt = attempt + 1
+                _note_retry(self._report, "probe {} failed ({})".format(name, ex))
+
+    def program(self, hex_path, erase=ERASE_ALL):
+        """Program and verify a hex file."""
+        self._retry("program", self._probe.program, hex_path, erase)
+
+    def read(self, addr, length=None):
+        """Read a word as an int or a number of bytes."""
+        if length is None:
+            return self._retry("read", self._probe.read, addr)
+        return self._retry("read", self._probe.read, addr, length)
+
+    def write(self, addr, data):
+        """Write bytes to RAM."""
+        self._retry("write", self._probe.write, addr, data)
 
+    def erase_all(self):
+        """Erase all of the flash."""
+        self._retry("erase", self._probe.erase_all)
 
-def _close_and_exit(nrfjprog_api, status):
-    """Close the nrfjprog connection if necessary and exit."""
-    if nrfjprog_api:
-        nrfjprog_api.close()
+    def reset(self):
+        """Reset the device and let it run."""
+        self._retry("reset", self._probe.reset)
+
+    def close(self):
+        """Release the wrapped probe."""
+        self._probe.close()
+
+
+class FlashStubProbe(object):
+    """Wrap a probe so that the credential page is programmed right after the firmware stub.
+
+    Programming a hex file that holds the credential page merges it with the stub (see
+    _merge_stub) and accesses to the page are redirected to where it was put.
+
+    With keep_flash only the pages that the stub and the page use are erased, so the rest of
+    flash is left as it was (see --delta). Those pages are collected in pages.
+    """
+
+    def __init__(self, probe, stub_hex, keep_flash=False):
+        self._probe = probe
+        self._stub_hex = stub_hex
+        self._keep_flash = keep_flash
+        self.page_addr, self._locator = _locate_page(stub_hex)
+        self.pages = set()
+        self.serial_number = probe.serial_number
+        self.uart_port = getattr(probe, "uart_port", None)
+
+    def _addr(self, addr):
+        """Translate an address in the credential page to where it was programmed."""
+        if CRED_PAGE_ADDR <= addr < CRED_PAGE_ADDR + FLASH_END_ADDR - self.page_addr:
+            return addr - CRED_PAGE_ADDR + self.page_addr
+        return addr
+
+    def program(self, hex_path, erase=ERASE_ALL):
+        """Program and verify the stub along with the credential page from a hex file."""
+        self.program_image(HexImage.load(hex_path), erase)
+
+    def program_image(self, intel_hex, erase=ERASE_ALL):
+        """Program and verify the stub along with the credential page from a loaded hex file."""
+        merged_hex = _merge_stub(self._stub_hex, intel_hex, (self.page_addr, self._locator))
+        if self._keep_flash:
+            erase = _sector_erase(merged_hex)
+        self.pages.update(_flash_pages(merged_hex))
+        _program_hex(self._probe, merged_hex, erase)
+
+    def read(self, addr, length=None):
+        """Read a word as an int or a number of bytes."""
+        if length is None:
+            return self._probe.read(self._addr(addr))
+        return self._probe.read(self._addr(addr), length)
+
+    def write(self, addr, data):
+        """Write bytes to RAM."""
+        self._probe.write(self._addr(addr), data)
+
+    def erase_all(self):
+        """Erase all of the flash."""
+        self._probe.erase_all()
+
+    def reset(self):
+        """Reset the device and let it run."""
+        self._probe.reset()
+
+    def close(self):
+        """Release the wrapped probe."""
+        self._probe.close()
+
+
+class RingChannel(object):
+    """Host side of the firmware's ring buffer channel, accessed through probe reads and writes.
+
+    Only the host moves the down buffer's write offset and the up buffer's read offset.
+    """
+
+    def __init__(self, probe, addr):
+        block = bytes(probe.read(addr, CHANNEL_LEN))
+        if block[:len(CHANNEL_ID)] != CHANNEL_ID:
+            raise CredError("Ring buffer channel not found.", -4)
+        self._probe = probe
+        self._up = self._ring(addr + CHANNEL_UP_OFFSET, block[CHANNEL_UP_OFFSET:])
+        self._down = self._ring(addr + CHANNEL_DOWN_OFFSET, block[CHANNEL_DOWN_OFFSET:])
+
+    @staticmethod
+    def _ring(desc_addr, desc):
+        """Return (descriptor address, buffer address, size) for a buffer descriptor."""
+        _, buf_addr, size = struct.unpack('<III', desc[:12])
+        return (desc_addr, buf_addr, size)
+
+    def _offsets(self, ring):
+        """Read a buffer's (write offset, read offset)."""
+        return struct.unpack('<II', bytes(self._probe.read(ring[0] + RING_WR_OFF_OFFSET, 8)))
+
+    def write(self, data):
+        """Write as much of data to the down buffer as fits and return the number of bytes."""
+        desc_addr, buf_addr, size = self._down
+        wr_off, rd_off = self._offsets(self._down)
+        count = min((rd_off - wr_off - 1) % size, len(data))
+        if not count:
+            return 0
+        first = min(count, size - wr_off)
+        self._probe.write(buf_addr + wr_off, data[:first])
+        if count > first:
+            self._probe.write(buf_addr, data[first:count])
+        self._probe.write(desc_addr + RING_WR_OFF_OFFSET,
+                          struct.pack('<I', (wr_off + count) % size))
+        return count
+
+    def read(self):
+        """Return everything that is waiting in the up buffer."""
+        desc_addr, buf_addr, size = self._up
+        wr_off, rd_off = self._offsets(self._up)
+        if wr_off == rd_off:
+            return b""
+        if wr_off > rd_off:
+            data = bytes(self._probe.read(buf_addr + rd_off, wr_off - rd_off))
+        else:
+            data = bytes(self._probe.read(buf_addr + rd_off, size - rd_off))
+            if wr_off:
+                data = data + bytes(self._probe.read(buf_addr, wr_off))
+        self._probe.write(desc_addr + RING_RD_OFF_OFFSET, struct.pack('<I', wr_off))
+        return data
+
+
+class SerialChannel(object):
+    """Host side of the firmware's UART transport, with the same interface as RingChannel."""
+
+    def __init__(self, port, baudrate):
+        if serial is None:
+            raise CredError("pyserial is required to use --transport uart", -1)
+        try:
+            self._serial = serial.Serial(port, baudrate, timeout=0)
+        except (serial.SerialException, ValueError) as ex:
+            raise CredError("Failed to open {} ({})".format(port, ex), -1)
+        self._serial.reset_input_buffer()
+
+    def write(self, data):
+        """Write data to the UART and return the number of bytes."""
+        return self._serial.write(data) or 0
+
+    def read(self):
+        """Return everything that has been received."""
+        return self._serial.read(self._serial.in_waiting)
+
+    def close(self):
+        """Close the serial port."""
+        self._serial.close()
+
+
+def _note_retry(report, reason):
+    """Count a retry in the report and print the reason to stderr."""
+    report["retries"] = report.get("retries", 0) + 1
+    print("retry {}: {}".format(report["retries"], reason), file=sys.stderr)
+
+
+def _flash_pages(intel_hex):
+    """Return the page numbers of the flash pages that a hex file uses."""
+    pages = set()
+    for start, end in intel_hex.segments():
+        if start < FLASH_END_ADDR:
+            pages.update(range(start // FLASH_PAGE_SIZE,
+                               (min(end, FLASH_END_ADDR) - 1) // FLASH_PAGE_SIZE + 1))
+    return pages
+
+
+def _sector_erase(intel_hex):
+    """Return the erase action that erases no more than a hex file needs: the flash pages that
+    it uses, and the UICR if it has anything outside of flash.
+    """
+    if any(start >= FLASH_END_ADDR for start, _ in intel_hex.segments()):
+        return ERASE_SECTOR_AND_UICR
+    return ERASE_SECTOR
+
+
+def _program_hex(probe, intel_hex, erase=ERASE_ALL):
+    """Program and verify a HexImage.
+
+    The stub wrappers take the object as it is. Anything else is handed a hex file since that
+    is what pynrfjprog programs.
+    """
+    if hasattr(probe, "program_image"):
+        probe.program_image(intel_hex, erase)
+        return
+    # Create a temporary file to pass to the probe and then delete it when finished.
+    tmp_file = os.path.sep.join((tempfile.mkdtemp(), TMP_FILE_NAME))
+    intel_hex.tofile(tmp_file, "hex")
+    try:
+        probe.program(tmp_file, erase)
+    finally:
+        os.remove(tmp_file)
+        os.removedirs(os.path.dirname(tmp_file))
+
+
+def _wait_for_word(probe, addr, timeout_s, start_s=0.0):
+    """Poll a flash word, starting after start_s, until the firmware writes it or the timeout
+    expires.
+    """
+    deadline = time.monotonic() + timeout_s
+    if start_s > 0:
+        time.sleep(min(start_s, timeout_s))
+    while True:
+        value = probe.read(addr)
+        if value != BLANK_FLASH_WORD or time.monotonic() >= deadline:
+            return value
+        time.sleep(POLL_INTERVAL_S)
+
+
+def _wait_for_halt(probe, timeout_s, start_s=0.0):
+    """Poll DHCSR, starting after start_s, until the core halts or the timeout expires and
+    return True if it halted.
+    """
+    deadline = time.monotonic() + timeout_s
+    if start_s > 0:
+        time.sleep(min(start_s, timeout_s))
+    while True:
+        if probe.read(DHCSR_ADDR) & DHCSR_S_HALT:
+            return True
+        if time.monotonic() >= deadline:
+            return False
+        time.sleep(POLL_INTERVAL_S)
+
+
+def _wait_for_result(probe, timeout_s, start_s=0.0, wait=WAIT_POLL):
+    """Wait for the firmware to finish, either by polling the result code or by waiting for it
+    to halt, and return the result code.
+    """
+    if wait == WAIT_HALT:
+        _wait_for_halt(probe, timeout_s, start_s)
+        return probe.read(FW_RESULT_CODE_ADDR)
+    return _wait_for_word(probe, FW_RESULT_CODE_ADDR, timeout_s, start_s)
+
+
+def _run_firmware(probe, intel_hex, fw_delay, timer, start_s=0.0, wait=WAIT_POLL):
+    """Program the hex file, allow it to run, and return the firmware's result code."""
+    with timer.phase("program"):
+        _program_hex(probe, intel_hex)
+    with timer.phase("fw_wait"):
+        return _wait_for_result(probe, fw_delay, start_s, wait)
+
+
+def _read_mailbox(probe, timeout_s):
+    """Poll the firmware's RAM mailbox and return its contents as a dict or None if the IMEI
+    doesn't appear.
+    """
+    deadline = time.monotonic() + timeout_s
+    mailbox_addr = _wait_for_word(probe, MAILBOX_ADDR_ADDR, timeout_s)
+    if mailbox_addr == BLANK_FLASH_WORD:
+        return None
+    while True:
+        mailbox = bytes(probe.read(mailbox_addr, MAILBOX_LEN))
+        if struct.unpack('<I', mailbox[:4])[0] == MAILBOX_MAGIC:
+            imei_bytes = mailbox[MAILBOX_IMEI_OFFSET:MAILBOX_IMEI_OFFSET + IMEI_LEN]
+            if not imei_bytes.isdigit():
+                return None
+            (cfun_ms, cfun_mode, cfun_changed,
+             cred_written, cred_ms, cred_batched, channel_addr, boot_ms) = struct.unpack(
+                 '<IBBHIB3xII', mailbox[MAILBOX_CFUN_OFFSET:MAILBOX_LEN])
+            return {"imei": imei_bytes.decode(),
+                    "cfun_ms": cfun_ms,
+                    "cfun_mode": cfun_mode,
+                    "cfun_changed": bool(cfun_changed),
+                    "cred_written": cred_written,
+                    "cred_ms": cred_ms,
+                    "cred_batched": bool(cred_batched),
+                    "channel_addr": channel_addr,
+                    "boot_ms": boot_ms}
+        if time.monotonic() >= deadline:
+            return None
+        time.sleep(POLL_INTERVAL_S)
+
+
+def _open_channel(probe, timeout_s):
+    """Wait for the firmware to publish its ring buffer channel and return a RingChannel."""
+    deadline = time.monotonic() + timeout_s
+    while True:
+        mailbox = _read_mailbox(probe, max(0.0, deadline - time.monotonic()))
+        if mailbox and mailbox["channel_addr"]:
+            return RingChannel(probe, mailbox["channel_addr"])
+        if time.monotonic() >= deadline:
+            raise CredError("Ring buffer channel not found.", -4)
+        time.sleep(POLL_INTERVAL_S)
+
+
+def _read_imei(probe):
+    """Read the IMEI that the firmware wrote to flash or return None if it isn't valid."""
+    imei_bytes = probe.read(IMEI_ADDR, IMEI_LEN + 1)
+    if (IMEI_LEN != imei_bytes.find(BLANK_FLASH_VALUE) or
+            not imei_bytes[:IMEI_LEN].isdigit()):
+        return None
+    return imei_bytes[:-1].decode()
+
+
+def _print_mailbox_stats(mailbox):
+    """Print the firmware's timing information to stderr."""
+    if not mailbox:
+        print("mailbox: not available", file=sys.stderr)
+        return
+    print("mailbox: first AT command {} ms after kernel start".format(mailbox["boot_ms"]),
+          file=sys.stderr)
+    print("mailbox: CFUN={} ({}) in {} ms".format(
+        mailbox["cfun_mode"],
+        "powered off" if mailbox["cfun_changed"] else "unchanged",
+        mailbox["cfun_ms"]), file=sys.stderr)
+    print("mailbox: {} credential(s) written {} in {} ms".format(
+        mailbox["cred_written"],
+        "batched" if mailbox["cred_batched"] else "one at a time",
+        mailbox["cred_ms"]), file=sys.stderr)
+
+
+def _close_and_exit(probe, status):
+    """Close the probe connection if necessary and exit."""
+    if probe:
+        probe.close()
     sys.exit(status)
 
 
 def _connect_to_jlink(args):
     """Connect to the debug probe."""
+    if not HighLevel:
+        raise CredError("pynrfjprog is required to use a J-Link", -1)
     api = HighLevel.API()
     api.open()
     connected_serials = api.get_connected_probes()
+    error = None
     if args.serial_number:
         if args.serial_number in connected_serials:
             connected_serials = [args.serial_number]
         else:
-            print("error: serial_number not found ({})".format(args.serial_number))
-            _close_and_exit(api, -1)
+            error = "serial_number not found ({})".format(args.serial_number)
     if not connected_serials:
-        print("error: no debug probes found")
-        _close_and_exit(api, -1)
-    if len(connected_serials) > 1:
-        print("error: multiple debug probes found, use --serial_number")
-        _close_and_exit(api, -1)
-    probe = HighLevel.DebugProbe(api, connected_serials[0], HighLevel.CoProcessor.CP_APPLICATION)
-    return (api, probe)
+        error = "no debug probes found"
+    elif len(connected_serials) > 1:
+        error = "multiple debug probes found, use --serial_number"
+    if error:
+        api.close()
+        raise CredError(error, -1)
+    return JLinkProbe(api, connected_serials[0])
+
+
+def _connect_to_probe(args, report):
+    """Connect to the debug probe backend selected by --probe and wrap it to retry failures."""
+    if args.probe.split(":")[0] == "mock":
+        import cred_mock
+        probe = cred_mock.MockProbe.from_spec(args.probe)
+    else:
+        probe = _connect_to_jlink(args)
+    return RetryingProbe(probe, args.retries, report)
 
 
 def _read_key_material_from_file(path):
-    """Read a certificate file and return it as a string. Line endings should be <LF>."""
-    with open(path, 'r') as in_file:
-        content = [line.strip() for line in in_file.readlines()]
-        content = '\n'.join(content)
-        if len(content) > MAX_KEY_MATERIAL_LEN_BYTES:
-            raise Exception("Key material is too long ({} bytes)".format(len(content)))
-        return content
-
-
-def _append_cred(intel_hex, sec_tag, cred_type, content):
-    """Append the specified credential to the hex file."""
-    addr = (intel_hex.maxaddr() + 1)
-    # [uint32_t nrf_sec_tag_t]
-    intel_hex.puts(addr, struct.pack('I', sec_tag))
-    addr = addr + 4
-    # [uint8_t nrf_key_mgnt_cred_type_t]
-    intel_hex[addr] = cred_type
-    addr = addr + 1
-    # [uin16_t len]
-    intel_hex.puts(addr, struct.pack('H', len(content)))
-    addr = addr + 2
-    # [uint8_t *credential]
-    intel_hex.puts(addr, content)
+    """Return the validated content of a PEM file, reading it only if it isn't already cached."""
+    stat = os.stat(path)
+    key = (os.path.realpath(path), stat.st_dev, stat.st_ino, stat.st_size, stat.st_mtime_ns)
+    digest = _key_material_digests.get(key)
+    content = _key_material.get(digest)
+    if content is None:
+        content = _parse_key_material_file(path)
+        digest = hashlib.sha256(content.encode('latin-1')).digest()
+        content = _key_material.get(digest, content)
+    _lru_put(_key_material_digests, key, digest, KEY_MATERIAL_CACHE_SIZE)
+    _lru_put(_key_material, digest, content, KEY_MATERIAL_CACHE_SIZE)
+    return content
+
+
+def _lru_put(cache, key, value, size):
+    """Store a value as the most recently used in an OrderedDict of no more than size entries."""
+    cache[key] = value
+    cache.move_to_end(key)
+    while len(cache) > size:
+        cache.popitem(last=False)
+
+
+def _parse_key_material_file(path):
+    """Read a PEM file, or a bundle of PEM blocks, and return it as a string.
+
+    The file is read a line at a time. Line endings are normalised to <LF> and any text outside
+    of the PEM blocks is dropped. The framing and base64 of each block are validated and the
+    file is rejected as soon as the content exceeds MAX_KEY_MATERIAL_LEN_BYTES.
+    """
+    content = []
+    length = 0
+    label = None
+    body = []
+    in_headers = False
+    blocks = 0
+    with open(path, 'rb') as in_file:
+        for line_num, raw_line in enumerate(in_file, 1):
+            try:
+                line = raw_line.strip().decode('ascii')
+            except UnicodeDecodeError:
+                raise CredError("{}:{}: not ASCII".format(path, line_num), -7)
+            if label is None:
+                match = PEM_BEGIN_PATTERN.match(line)
+                if not match:
+                    if line.startswith("-----"):
+                        raise CredError("{}:{}: unexpected '{}'".format(path, line_num, line),
+                                        -7)
+                    continue
+                label = match.group(1) or ""
+                body = []
+                in_headers = True
+            elif line == PEM_END_FORMAT.format(label):
+                try:
+                    base64.b64decode("".join(body), validate=True)
+                except binascii.Error as ex:
+                    raise CredError("{}:{}: invalid base64 ({})".format(path, line_num, ex), -7)
+                label = None
+                blocks = blocks + 1
+            elif line.startswith("-----"):
+                raise CredError("{}:{}: expected '{}'".format(
+                    path, line_num, PEM_END_FORMAT.format(label)), -7)
+            elif in_headers and PEM_HEADER_PATTERN.match(line):
+                # RFC 1421 encapsulated headers, e.g. in encrypted private keys.
+                pass
+            elif in_headers and not line and not body:
+                in_headers = False
+            else:
+                in_headers = False
+                body.append(line)
+            length = length + len(line) + (1 if content else 0)
+            if length > MAX_KEY_MATERIAL_LEN_BYTES:
+                raise CredError("Key material is too long (more than {} bytes in {})".format(
+                    MAX_KEY_MATERIAL_LEN_BYTES, path), -7)
+            content.append(line)
+    if label is not None:
+        raise CredError("{}: missing '{}'".format(path, PEM_END_FORMAT.format(label)), -7)
+    if not blocks:
+        raise CredError("{}: no PEM blocks found".format(path), -7)
+    return '\n'.join(content)
+
+
+@functools.lru_cache(maxsize=CRED_RECORD_CACHE_SIZE)
+def _encode_cred(sec_tag, cred_type, content):
+    """Return the record for the specified credential as bytes, using the cache if possible."""
+    if isinstance(content, str):
+        content = content.encode('latin-1')
+    # [uint32_t nrf_sec_tag_t][uint8_t nrf_key_mgnt_cred_type_t][uin16_t len]
+    #     [uint8_t *credential]
+    return struct.pack('<IBH', sec_tag, cred_type, len(content)) + content
+
+
+def _encode_creds(creds):
+    """Return the records for a list of (sec_tag, cred_type, content) as one contiguous blob."""
+    return b"".join([_encode_cred(sec_tag, cred_type, content)
+                     for sec_tag, cred_type, content in creds])
+
+
+def _append_encoded_creds(intel_hex, creds):
+    """Append a list of (sec_tag, cred_type, content) to the hex file and update RECORDS_LEN.
+
+    Each puts() merges with the segments that it touches, so the records are encoded into one
+    blob and inserted with a single puts() instead of one per field.
+    """
+    addr = intel_hex.maxaddr() + 1
+    blob = _encode_creds(creds)
+    intel_hex.puts(addr, blob)
+    intel_hex.puts(RECORDS_LEN_ADDR, struct.pack('<I', addr + len(blob) - FIRST_CRED_ADDR))
+
+
+def _read_creds(intel_hex):
+    """Return the credentials in the hex file as a list of (sec_tag, cred_type, content)."""
+    records_len = struct.unpack('<I', intel_hex.gets(RECORDS_LEN_ADDR, 4))[0]
+    if records_len == BLANK_FLASH_WORD:
+        return []
+    creds = []
+    addr = FIRST_CRED_ADDR
+    end = FIRST_CRED_ADDR + records_len
+    while addr < end:
+        sec_tag, cred_type, length = struct.unpack('<IBH', intel_hex.gets(addr, 7))
+        addr = addr + 7
+        creds.append((sec_tag, cred_type, intel_hex.gets(addr, length)))
+        addr = addr + length
+    return creds
+
+
+def _cred_digest(intel_hex):
+    """Return the CRC32 of the credential records, as computed by the firmware."""
+    return zlib.crc32(intel_hex.gets(FIRST_CRED_ADDR, intel_hex.maxaddr() + 1 - FIRST_CRED_ADDR))
+
+
+def _cred_profile(intel_hex):
+    """Return the key that the firmware's completion time is recorded under in the history."""
+    return "{}:{}:{}".format(intel_hex[MODE_ADDR],
+                             len(_read_creds(intel_hex)),
+                             intel_hex.maxaddr() + 1 - FIRST_CRED_ADDR)
+
+
+def _load_history(path):
+    """Load the completion times from the history file as a dict of profile -> [seconds]."""
+    try:
+        with open(path, 'r') as history_file:
+            return json.load(history_file)
+    except FileNotFoundError:
+        return {}
+
+
+def _save_history(path, history, profile, seconds):
+    """Add a completion time to the history and write it back to the history file."""
+    samples = history.setdefault(profile, [])
+    samples.append(round(seconds, 3))
+    del samples[:-HISTORY_SAMPLES]
+    tmp_path = path + ".tmp"
+    with open(tmp_path, 'w') as history_file:
+        json.dump(history, history_file, indent=1, sort_keys=True)
+    os.replace(tmp_path, path)
+
+
+def _predict_fw_wait(args, history, intel_hex):
+    """Return how long to wait for the firmware and when to start polling, in seconds.
+
+    An explicit --fw_delay always wins. Otherwise the history for the hex file's profile is
+    used, falling back to DEFAULT_CRED_WRITE_TIME_S for profiles that haven't been seen yet.
+    """
+    if args.fw_delay:
+        return (args.fw_delay, 0.0)
+    samples = (history or {}).get(_cred_profile(intel_hex))
+    if not samples:
+        return (DEFAULT_CRED_WRITE_TIME_S, 0.0)
+    return (max(samples) * HISTORY_MARGIN + HISTORY_MARGIN_S, min(samples) * HISTORY_START)
+
+
+def _build_remaining_hex(intel_hex, first):
+    """Return a copy of the hex file that only holds the credentials from index first onwards."""
+    remaining_hex = intel_hex[:FIRST_CRED_ADDR]
+    _append_encoded_creds(remaining_hex, _read_creds(intel_hex)[first:])
+    return remaining_hex
+
+
+def _build_mode_hex(intel_hex, mode):
+    """Return a copy of the hex file without any credentials that runs in the given mode."""
+    mode_hex = intel_hex[:FIRST_CRED_ADDR]
+    mode_hex[MODE_ADDR] = mode
+    mode_hex.puts(RECORDS_LEN_ADDR, struct.pack('<I', 0))
+    return mode_hex
+
+
+def _parse_cred_list(raw):
+    """Parse an AT%CMNG=1 listing into a dict of (sec_tag, cred_type) -> SHA-256 string."""
+    text = bytes(raw).split(b'\x00')[0].decode('ascii', 'replace')
+    return {(int(sec_tag), int(cred_type)): sha.upper()
+            for sec_tag, cred_type, sha in CRED_LIST_PATTERN.findall(text)}
+
+
+def _expand_imei(content, imei):
+    """Return a credential's content as the firmware writes it to the modem (see
+    IMEI_PLACEHOLDER).
+    """
+    return content.replace(IMEI_PLACEHOLDER, imei.encode())
+
+
+def _creds_match(cred_list, creds, imei):
+    """Return True if every credential is already stored in the modem with the same content."""
+    for sec_tag, cred_type, content in creds:
+        sha = hashlib.sha256(_expand_imei(content, imei)).hexdigest().upper()
+        if cred_list.get((sec_tag, cred_type)) != sha:
+            return False
+    return True
 
 
 def _append_creds(intel_hex, args):
     """Iterate through the provided credential arguments and add them"""
-    count = struct.unpack('B', intel_hex.gets(CRED_COUNT_ADDR, 1))[0]
+    creds = []
     if args.psk:
-        _append_cred(intel_hex, args.sec_tag, CRED_TYPE_PSK, args.psk)
-        count = count + 1
+        creds.append((args.sec_tag, CRED_TYPE_PSK, args.psk))
     if args.psk_ident:
-        _append_cred(intel_hex, args.sec_tag, CRED_TYPE_PSK_IDENTITY, args.psk_ident)
-        count = count + 1
+        creds.append((args.sec_tag, CRED_TYPE_PSK_IDENTITY, args.psk_ident))
     if args.CA_cert:
-        _append_cred(intel_hex,
-                     args.sec_tag,
-                     CRED_TYPE_ROOT_CA,
-                     _read_key_material_from_file(args.CA_cert))
-        count = count + 1
+        creds.append((args.sec_tag,
+                      CRED_TYPE_ROOT_CA,
+                      _read_key_material_from_file(args.CA_cert)))
     if args.client_cert:
-        _append_cred(intel_hex,
-                     args.sec_tag,
-                     CRED_TYPE_CLIENT_CERT,
-                     _read_key_material_from_file(args.client_cert))
-        count = count + 1
+        creds.append((args.sec_tag,
+                      CRED_TYPE_CLIENT_CERT,
+                      _read_key_material_from_file(args.client_cert)))
     if args.client_private_key:
-        _append_cred(intel_hex,
-                     args.sec_tag,
-                     CRED_TYPE_CLIENT_PRIVATE_KEY,
-                     _read_key_material_from_file(args.client_private_key))
-        count = count + 1
-    intel_hex.puts(CRED_COUNT_ADDR, struct.pack('B', count))
+        creds.append((args.sec_tag,
+                      CRED_TYPE_CLIENT_PRIVATE_KEY,
+                      _read_key_material_from_file(args.client_private_key)))
+    _append_encoded_creds(intel_hex, creds)
 
 
-def _add_and_parse_args():
-    """Build the argparse object and parse the args."""
+def _add_and_parse_args(argv=None):
+    """Build the argparse object and parse the args (from the command line by default)."""
     parser = argparse.ArgumentParser(prog='cred',
                                      description=('A command line interface for ' +
                                                   'managing nRF91 credentials via SWD.'),
@@ -159,8 +1124,11 @@ def _add_and_parse_args():
                         help="read existing hex file instead of generating a new one")
     parser.add_argument("-o", "--out_file", type=str, metavar="OUT_FILE_PATH",
                         help="write output from read operation to file instead of programming it")
+    parser.add_argument("--stub_hex", type=str, metavar="STUB_HEX_PATH",
+                        help="prebuilt firmware hex file to add the credentials to " +
+                        "(default: {}, or a stand-in with probe mock)".format(HEX_PATH))
     parser.add_argument("-d", "--fw_delay", type=int, metavar="FW_EXECUTE_DELAY",
-                        help="delay in seconds to allow firmware on nRF91 to execute")
+                        help="maximum time in seconds to allow firmware on nRF91 to execute")
     parser.add_argument("-s", "--serial_number", type=int, metavar="JLINK_SERIAL_NUMBER",
                         help="serial number of J-Link")
     parser.add_argument("--sec_tag", type=int,
@@ -168,18 +1136,63 @@ def _add_and_parse_args():
     parser.add_argument("--psk", type=str, metavar="PRESHARED_KEY",
                         help="add a preshared key (PSK) as a string")
     parser.add_argument("--psk_ident", type=str, metavar="PRESHARED_KEY_IDENTITY",
-                        help="add a preshared key (PSK) identity as a string")
+                        help="add a preshared key (PSK) identity as a string, with any " +
+                        "{IMEI} replaced with the device's IMEI")
     parser.add_argument("--CA_cert", type=str, metavar="CA_ROOT_CERT_PATH",
                         help="path to a root Certificate Authority certificate")
     parser.add_argument("--client_cert", type=str, metavar="CLIENT_CERT_PATH",
                         help="path to a client certificate")
     parser.add_argument("--client_private_key", type=str, metavar="CLIENT_PRIVATE_KEY_PATH",
                         help="path to a client private key")
+    parser.add_argument("--keygen", action='store_true',
+                        help="have the modem generate the client private key and write a " +
+                        "client certificate for it in the same boot (requires transport rtt)")
+    parser.add_argument("--signing_cert", type=str, metavar="SIGNING_CA_CERT_PATH",
+                        help="certificate of the local CA that signs the CSR from keygen")
+    parser.add_argument("--signing_key", type=str, metavar="SIGNING_CA_KEY_PATH",
+                        help="private key of the local CA that signs the CSR from keygen")
     parser.add_argument("--imei_only", action='store_true',
                         help="only read the IMEI and exit without writing any credentials")
     parser.add_argument("--program_app", type=str, metavar="APP_HEX_FILE_PATH",
                         help="program specified hex file to device before finishing")
-    args = parser.parse_args()
+    parser.add_argument("--delta", action='store_true',
+                        help="with program_app, only erase and program the flash pages that " +
+                        "differ from the device")
+    parser.add_argument("--check", action='store_true',
+                        help="list the credentials stored in the modem first and skip writing " +
+                        "them if they already match")
+    parser.add_argument("--batch", action='store_true',
+                        help="write all credentials back-to-back through a single AT socket")
+    parser.add_argument("--fragmented", action='store_true',
+                        help="with batch, send each AT%%CMNG command in pieces instead of " +
+                        "staging it in a buffer (experimental, not verified on hardware)")
+    parser.add_argument("--probe", type=str, default="jlink", metavar="PROBE",
+                        help="debug probe backend: 'jlink' (default) or " +
+                        "'mock[:option=value,...]' to simulate an nRF91 in memory")
+    parser.add_argument("--log", type=str, metavar="LOG_FILE_PATH",
+                        help="append a JSON line describing the run to the specified file")
+    parser.add_argument("--retries", type=int, default=DEFAULT_RETRIES, metavar="RETRIES",
+                        help="number of times to retry a failed probe transaction, firmware " +
+                        "timeout, or credential write (default: {})".format(DEFAULT_RETRIES))
+    parser.add_argument("--history", type=str, metavar="HISTORY_FILE_PATH",
+                        help="record firmware completion times in the specified file and use " +
+                        "them to predict how long to wait when fw_delay isn't given")
+    parser.add_argument("--wait", type=str, choices=(WAIT_POLL, WAIT_HALT), default=WAIT_POLL,
+                        help="detect that the firmware has finished by polling its result " +
+                        "code (default) or by waiting for the core to halt")
+    parser.add_argument("--transport", type=str,
+                        choices=(TRANSPORT_FLASH, TRANSPORT_RTT, TRANSPORT_UART),
+                        default=TRANSPORT_FLASH,
+                        help="pass the credentials to the firmware in flash (default), " +
+                        "stream them through a ring buffer in RAM, or send them over its UART")
+    parser.add_argument("--port", type=str, metavar="SERIAL_PORT",
+                        help="serial port connected to the device's UART_0 for transport uart")
+    parser.add_argument("--baudrate", type=int, default=DEFAULT_BAUDRATE, metavar="BAUDRATE",
+                        help="baud rate for transport uart (default: {})".format(
+                            DEFAULT_BAUDRATE))
+    parser.add_argument("-v", "--verbose", action='store_true',
+                        help="print firmware timing information to stderr")
+    args = parser.parse_args(argv)
     if args.psk:
         if args.psk.upper().startswith("0X"):
             args.psk = args.psk[2:]
@@ -188,7 +1201,7 @@ def _add_and_parse_args():
         print("error: sec_tag is required")
         sys.exit(-1)
     creds_present = (args.psk or args.psk_ident or args.CA_cert or
-                     args.client_cert or args.client_private_key)
+                     args.client_cert or args.client_private_key or args.keygen)
     if args.imei_only:
         if creds_present:
             parser.print_usage()
@@ -198,71 +1211,586 @@ def _add_and_parse_args():
         parser.print_usage()
         print("error: at least one credential is required")
         sys.exit(-1)
+    if args.check and args.imei_only:
+        parser.print_usage()
+        print("error: check can't be used with imei_only")
+        sys.exit(-1)
     if args.out_file:
-        if args.serial_number or args.fw_delay:
+        if args.serial_number or args.fw_delay or args.check or args.history:
             parser.print_usage()
-            print("error: out_file is mutually exclusive with delay or serial_number")
+            print("error: out_file is mutually exclusive with delay, serial_number, check, " +
+                  "or history")
             sys.exit(-1)
-    else:
+    elif not args.history:
         if not args.fw_delay:
             args.fw_delay = DEFAULT_CRED_WRITE_TIME_S
+    if args.transport != TRANSPORT_FLASH and (args.batch or args.out_file):
+        parser.print_usage()
+        print("error: transport {} can't be used with batch or out_file".format(args.transport))
+        sys.exit(-1)
+    if args.fragmented and not args.batch:
+        parser.print_usage()
+        print("error: fragmented requires batch")
+        sys.exit(-1)
+    if args.port and args.transport != TRANSPORT_UART:
+        parser.print_usage()
+        print("error: port can only be used with transport uart")
+        sys.exit(-1)
+    if args.delta and (not args.program_app or args.out_file):
+        parser.print_usage()
+        print("error: delta requires program_app and can't be used with out_file")
+        sys.exit(-1)
+    if args.delta and args.check:
+        parser.print_usage()
+        print("error: delta can't be used with check")
+        sys.exit(-1)
+    if args.keygen and (args.transport != TRANSPORT_RTT or args.check or
+                        args.client_cert or args.client_private_key):
+        parser.print_usage()
+        print("error: keygen requires transport rtt and can't be used with check, " +
+              "client_cert, or client_private_key")
+        sys.exit(-1)
+    if args.keygen and not (args.signing_cert and args.signing_key):
+        parser.print_usage()
+        print("error: keygen requires signing_cert and signing_key")
+        sys.exit(-1)
+    if args.retries < 0:
+        parser.print_usage()
+        print("error: retries can't be negative")
+        sys.exit(-1)
     return args
 
 
+def _find_locators(intel_hex):
+    """Return the addresses of the words in flash that match the locator's magic number."""
+    locators = []
+    for start, end in intel_hex.segments():
+        if start >= FLASH_END_ADDR:
+            continue
+        data = intel_hex.tobinstr(start, end - 1)
+        index = data.find(LOCATOR_MAGIC_BYTES)
+        while index >= 0:
+            if (start + index) % 4 == 0 and index + LOCATOR_LEN <= len(data):
+                locators.append(start + index)
+            index = data.find(LOCATOR_MAGIC_BYTES, index + 1)
+    return locators
+
+
+def _flash_end(intel_hex):
+    """Return the address after the last byte of a hex file in flash."""
+    return max([end for start, end in intel_hex.segments() if start < FLASH_END_ADDR] or [0])
+
+
+def _locate_page(stub_hex):
+    """Return (page address, locator address) for a stub, where the page address is the first
+    flash page boundary after it.
+    """
+    locators = _find_locators(stub_hex)
+    if len(locators) > 1:
+        raise CredError("More than one locator found in hex file.", -2)
+    if not locators:
+        raise CredError("Prebuilt hex file predates the current credential page layout " +
+                        "(no locator), rebuild it from src/main.c and pass it with --stub_hex.",
+                        -2)
+    page_addr = -(-_flash_end(stub_hex) // FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE
+    return (page_addr, locators[0])
+
+
+def _merge_stub(stub_hex, intel_hex, location=None):
+    """Return a copy of the stub with the credential page from intel_hex after it and the
+    locator patched to point at it. location is the result of _locate_page if known.
+    """
+    page_addr, locator = location or _locate_page(stub_hex)
+    page = intel_hex.tobinstr(CRED_PAGE_ADDR, intel_hex.maxaddr())
+    if page_addr + len(page) > FLASH_END_ADDR:
+        raise CredError("Credentials don't fit in flash.", -3)
+    merged_hex = stub_hex[:]
+    merged_hex.puts(locator + 4, struct.pack('<I', page_addr))
+    merged_hex.puts(page_addr, page)
+    return merged_hex
+
+
+def _split_hex(intel_hex):
+    """Split a hex file written with --out_file into the stub and the credential page, moved
+    back to CRED_PAGE_ADDR. The page is None if the hex file doesn't have one.
+    """
+    page_addr = CRED_PAGE_ADDR
+    locators = _find_locators(intel_hex)
+    if locators:
+        page_addr = struct.unpack('<I', intel_hex.gets(locators[0] + 4, 4))[0]
+    # The page runs to the end of the hex file's data in flash.
+    page_end = _flash_end(intel_hex)
+    if (page_end - page_addr < FIRST_CRED_ADDR - CRED_PAGE_ADDR or
+            intel_hex.tobinstr(page_addr, page_addr + 3) != MAGIC_NUMBER_BYTES):
+        if page_end > page_addr and not locators:
+            raise CredError("Magic number not found in hex file.", -2)
+        return (intel_hex, None)
+    stub_hex = intel_hex[:page_addr]
+    for start, end in intel_hex[page_end:].segments():
+        stub_hex.puts(start, intel_hex.tobinstr(start, end - 1))
+    page_hex = HexImage()
+    page_hex.puts(CRED_PAGE_ADDR, intel_hex.tobinstr(page_addr, page_end - 1))
+    return (stub_hex, page_hex)
+
+
+def _stub_probe(args, probe, stub_hex):
+    """Wrap a probe so that the credential page is programmed after the firmware stub."""
+    return FlashStubProbe(probe, stub_hex, keep_flash=args.delta)
+
+
+def _load_stub(args):
+    """Load the prebuilt firmware from stub_hex. The mock probe only models the firmware, so
+    without stub_hex it gets a stand-in (see cred_mock.stub_hex) instead of HEX_PATH.
+    """
+    if args.stub_hex is None and args.probe.split(":")[0] == "mock":
+        import cred_mock
+        return cred_mock.stub_hex()
+    return HexImage.load(args.stub_hex or HEX_PATH)
+
+
+def _build_hex(args):
+    """Load the prebuilt hex file (stub_hex, or in_file) and build the credential page with the
+    credentials appended to it.
+
+    Returns the stub and the page, which is at CRED_PAGE_ADDR on its own until it's merged with
+    the stub (see _merge_stub).
+    """
+    intel_hex = None
+    if args.in_file:
+        stub_hex, intel_hex = _split_hex(HexImage.load(args.in_file))
+    else:
+        stub_hex = _load_stub(args)
+    if intel_hex is None:
+        intel_hex = HexImage()
+        intel_hex.puts(CRED_PAGE_ADDR, MAGIC_NUMBER_BYTES)
+        intel_hex.puts(RECORDS_LEN_ADDR, struct.pack('<I', 0))
+    if args.fragmented:
+        intel_hex[MODE_ADDR] = MODE_WRITE_FRAGMENTED
+    else:
+        intel_hex[MODE_ADDR] = MODE_WRITE_BATCHED if args.batch else MODE_WRITE
+    _append_creds(intel_hex, args)
+    return (stub_hex, intel_hex)
+
+
+def _write_creds(args, probe, intel_hex, timer, report, history=None):
+    """Run the hex file until the firmware reports success or the retries run out.
+
+    A firmware timeout resets the device and polls again. A failed credential write programs a
+    new hex file that only holds the credentials that weren't written. Returns the hex file
+    that the firmware finally succeeded with. If the firmware wrote every credential of the
+    original hex file in one run then the time that it took is added to the report as
+    fw_time_s.
+    """
+    retries = 0
+    original_hex = intel_hex
+    fw_delay, start_s = _predict_fw_wait(args, history, intel_hex)
+    fw_wait_s = timer.phases.get("fw_wait", 0.0)
+    result_code = _run_firmware(probe, intel_hex, fw_delay, timer, start_s, args.wait)
+    while True:
+        if not result_code and intel_hex is original_hex:
+            report["fw_time_s"] = timer.phases["fw_wait"] - fw_wait_s
+        report["fw_result"] = result_code
+        mailbox = None
+        if result_code or args.verbose or args.log:
+            with timer.phase("read"):
+                mailbox = _read_mailbox(probe, 0)
+            report["mailbox"] = mailbox
+            if args.verbose:
+                _print_mailbox_stats(mailbox)
+        if not result_code:
+            return intel_hex
+        if retries >= args.retries:
+            raise CredError("Firmware result is 0x{:X}".format(result_code), -4)
+        retries = retries + 1
+        if result_code == BLANK_FW_RESULT_CODE:
+            _note_retry(report, "firmware timed out, resetting")
+            # The prediction may have been too tight so allow more time on the next attempt.
+            fw_delay = fw_delay * 2
+            with timer.phase("program"):
+                probe.reset()
+            fw_wait_s = timer.phases["fw_wait"]
+            with timer.phase("fw_wait"):
+                result_code = _wait_for_result(probe, fw_delay, wait=args.wait)
+        else:
+            written = mailbox["cred_written"] if mailbox else 0
+            _note_retry(report, "credential {} failed with 0x{:X}, rewriting from there".format(
+                written, result_code))
+            intel_hex = _build_remaining_hex(intel_hex, written)
+            fw_delay, start_s = _predict_fw_wait(args, history, intel_hex)
+            result_code = _run_firmware(probe, intel_hex, fw_delay, timer, start_s, args.wait)
+
+
+def _frame_record(record):
+    """Return a record framed for the UART transport."""
+    return (struct.pack(FRAME_HEADER_FORMAT, len(record)) + record +
+            struct.pack(FRAME_CRC_FORMAT, zlib.crc32(record)))
+
+
+def _stream_once(args, probe, mode_hex, creds, timer, channel=None):
+    """Run the firmware in MODE_STREAM or MODE_UART, stream the credentials to it, and return a
+    list of (index, result) for each record and the (result, count, crc) that it finished with.
+
+    If the firmware is already running and has published its ring buffer channel (see
+    _keygen_creds) then the channel is given instead and nothing is programmed.
+    """
+    timeout_s = args.fw_delay or DEFAULT_CRED_WRITE_TIME_S
+    records = [_encode_cred(*cred) for cred in creds] + [STREAM_END_RECORD]
+    if args.transport == TRANSPORT_UART:
+        port = args.port or getattr(probe, "uart_port", None)
+        if not port:
+            raise CredError("A serial port is required for transport uart (see --port).", -1)
+        # Opened before the firmware starts so that "%READY" isn't missed.
+        channel = SerialChannel(port, args.baudrate)
+        records = [_frame_record(record) for record in records]
+        window = None
+        with timer.phase("program"):
+            _program_hex(probe, mode_hex)
+    else:
+        if channel is None:
+            with timer.phase("program"):
+                _program_hex(probe, mode_hex)
+            with timer.phase("fw_wait"):
+                channel = _open_channel(probe, timeout_s)
+        # The ring buffer can't be overrun so there is no need to limit what is in flight.
+        window = sum(len(record) for record in records)
+
+    data = b"".join(records)
+    ends = [0]
+    for record in records:
+        ends.append(ends[-1] + len(record))
+    sent = 0
+    received = b""
+    results = []
+    done = None
+    idle_since = time.monotonic()
+    try:
+        with timer.phase("stream"):
+            while done is None:
+                count = 0
+                if window is not None and sent < len(data):
+                    # The first record that hasn't been answered can always be sent in full
+                    # since the firmware is busy receiving it.
+                    answered = min(len(results), len(records) - 1)
+                    limit = max(ends[answered] + window, ends[answered + 1])
+                    count = channel.write(data[sent:limit])
+                sent = sent + count
+                incoming = channel.read()
+                lines = (received + incoming).split(b"\n")
+                received = lines.pop()
+                for line in lines:
+                    line = line.decode('ascii', 'replace').rstrip("\r")
+                    cred_match = STREAM_CRED_PATTERN.match(line)
+                    done_match = STREAM_DONE_PATTERN.match(line)
+                    ready_match = STREAM_READY_PATTERN.match(line)
+                    if cred_match:
+                        results.append((int(cred_match.group(1)), int(cred_match.group(2))))
+                    elif done_match:
+                        done = tuple(int(value) for value in done_match.groups())
+                    elif ready_match and window is None:
+                        window = int(ready_match.group(1))
+                    elif args.verbose:
+                        print("fw: " + line, file=sys.stderr)
+                if count or incoming:
+                    idle_since = time.monotonic()
+                elif time.monotonic() - idle_since >= timeout_s:
+                    raise CredError("Firmware stopped responding.", -4)
+                else:
+                    time.sleep(POLL_INTERVAL_S)
+    finally:
+        if args.transport == TRANSPORT_UART:
+            channel.close()
+    return results, done
+
+
+def _read_csr(probe):
+    """Read the CSR that the firmware wrote in MODE_KEYGEN and return it as DER."""
+    data = bytes(probe.read(CSR_ADDR, MAX_CSR_LEN_BYTES))
+    text = data.split(b'\x00')[0]
+    if not text or len(text) == len(data):
+        raise CredError("CSR does not look valid.", -4)
+    try:
+        return base64.urlsafe_b64decode(text + b'=' * (-len(text) % 4))
+    except (binascii.Error, ValueError):
+        raise CredError("CSR does not look valid.", -4)
+
+
+def _sign_csr(args, csr):
+    """Return a PEM client certificate for a DER CSR, signed with openssl by the CA in
+    --signing_cert and --signing_key.
+    """
+    body = base64.b64encode(csr).decode()
+    pem = "\n".join([PEM_BEGIN_FORMAT.format(CSR_PEM_LABEL)] +
+                    [body[i:i + 64] for i in range(0, len(body), 64)] +
+                    [PEM_END_FORMAT.format(CSR_PEM_LABEL), ""])
+    command = [OPENSSL, "x509", "-req", "-sha256", "-days", str(CERT_DAYS),
+               "-set_serial", "0x" + binascii.hexlify(os.urandom(16)).decode(),
+               "-CA", args.signing_cert, "-CAkey", args.signing_key]
+    try:
+        result = subprocess.run(command, input=pem.encode(), stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE)
+    except OSError as ex:
+        raise CredError("Failed to run {} ({})".format(OPENSSL, ex), -1)
+    if result.returncode or not result.stdout.startswith(CERT_PEM_BEGIN):
+        errors = result.stderr.decode('ascii', 'replace').strip().splitlines()
+        raise CredError("Failed to sign the CSR ({})".format("; ".join(errors)), -7)
+    return result.stdout.replace(b"\r\n", b"\n")
+
+
+def _keygen_creds(args, probe, intel_hex, timer):
+    """Run the firmware in MODE_KEYGEN and return its ring buffer channel and the credentials to
+    stream to it: those in the hex file followed by a client certificate for the modem's CSR.
+    """
+    keygen_hex = _build_mode_hex(intel_hex, MODE_KEYGEN)
+    _append_encoded_creds(keygen_hex, [(args.sec_tag, CRED_TYPE_CLIENT_PRIVATE_KEY, b"")])
+    with timer.phase("program"):
+        _program_hex(probe, keygen_hex)
+    with timer.phase("fw_wait"):
+        try:
+            channel = _open_channel(probe, args.fw_delay or DEFAULT_CRED_WRITE_TIME_S)
+        except CredError:
+            # The firmware gives up without publishing the channel if AT%KEYGEN fails.
+            result_code = probe.read(FW_RESULT_CODE_ADDR)
+            if result_code != BLANK_FW_RESULT_CODE:
+                raise CredError("Firmware result is 0x{:X}".format(result_code), -4)
+            raise
+    with timer.phase("read"):
+        csr = _read_csr(probe)
+    with timer.phase("sign"):
+        cert = _sign_csr(args, csr)
+    return (channel, _read_creds(intel_hex) + [(args.sec_tag, CRED_TYPE_CLIENT_CERT, cert)])
+
+
+def _stream_creds(args, probe, intel_hex, timer, report):
+    """Write the credentials by streaming them through the firmware's ring buffer channel or
+    its UART.
+
+    The firmware reports the result of every record so a retry only streams the ones that
+    failed or that it didn't get to.
+    """
+    mode_hex = _build_mode_hex(intel_hex,
+                               MODE_UART if args.transport == TRANSPORT_UART else MODE_STREAM)
+    creds = _read_creds(intel_hex)
+    channel = None
+    if args.keygen:
+        # A retry streams the certificate again without generating another key.
+        channel, creds = _keygen_creds(args, probe, intel_hex, timer)
+    retries = 0
+    while True:
+        results, (result_code, count, crc) = _stream_once(args, probe, mode_hex, creds, timer,
+                                                          channel)
+        channel = None
+        report["fw_result"] = result_code & BLANK_FW_RESULT_CODE
+        if result_code or args.verbose or args.log:
+            with timer.phase("read"):
+                report["mailbox"] = _read_mailbox(probe, 0)
+            if args.verbose:
+                _print_mailbox_stats(report["mailbox"])
+        # A stream that the firmware gave up on (e.g. a UART frame with a corrupted length)
+        # ends early with an error, and the records that it didn't answer are streamed again.
+        aborted = result_code and count < len(creds)
+        # Over the UART every record carries its own CRC instead.
+        if not aborted and (count != len(creds) or (args.transport == TRANSPORT_RTT and
+                                                    crc != zlib.crc32(_encode_creds(creds)))):
+            raise CredError("Credential digest does not match.", -6)
+        failed = [creds[index] for index, result in results if result] + creds[count:]
+        if not failed:
+            return
+        if retries >= args.retries:
+            raise CredError("Firmware result is 0x{:X}".format(report["fw_result"]), -4)
+        retries = retries + 1
+        _note_retry(report, "{} credential(s) failed with 0x{:X}, streaming them again".format(
+            len(failed), report["fw_result"]))
+        creds = failed
+
+
+def _provision(args, probe, intel_hex, timer, report=None, history=None, erase=True):
+    """Run the hex file on the device, verify the result, erase it, and return the IMEI.
+
+    If a report dict is given then the firmware's result code, the mailbox, and whether the
+    write was skipped are added to it. If a history dict (see _load_history) is given then it
+    is used to predict how long the firmware takes. If erase is False then the hex file is left
+    in flash for the caller to overwrite (see _program_app_delta).
+    """
+    if report is None:
+        report = {}
+    if args.imei_only:
+        with timer.phase("program"):
+            _program_hex(probe, _build_mode_hex(intel_hex, MODE_IMEI))
+        with timer.phase("fw_wait"):
+            mailbox = _read_mailbox(probe, args.fw_delay or DEFAULT_CRED_WRITE_TIME_S)
+        report["mailbox"] = mailbox
+        if not mailbox:
+            raise CredError("IMEI does not look valid.", -5)
+        if args.verbose:
+            _print_mailbox_stats(mailbox)
+        imei = mailbox["imei"]
+    else:
+        skip_write = False
+        if args.check:
+            result_code = _run_firmware(probe,
+                                        _build_mode_hex(intel_hex, MODE_CHECK),
+                                        DEFAULT_CRED_CHECK_TIME_S,
+                                        timer,
+                                        wait=args.wait)
+            report["fw_result"] = result_code
+            if result_code:
+                raise CredError("Firmware result is 0x{:X}".format(result_code), -4)
+            with timer.phase("read"):
+                cred_list = _parse_cred_list(probe.read(CHECK_LIST_ADDR,
+                                                        MAX_CRED_LIST_LEN_BYTES))
+                imei = _read_imei(probe)
+            if not imei:
+                raise CredError("IMEI does not look valid.", -5)
+            skip_write = _creds_match(cred_list, _read_creds(intel_hex), imei)
+        report["skipped"] = skip_write
+        if not skip_write and args.transport != TRANSPORT_FLASH:
+            _stream_creds(args, probe, intel_hex, timer, report)
+        elif not skip_write:
+            written_hex = _write_creds(args, probe, intel_hex, timer, report, history)
+            with timer.phase("read"):
+                digest = probe.read(CRED_DIGEST_ADDR)
+            if digest != _cred_digest(written_hex):
+                raise CredError("Credential digest does not match.", -6)
+        with timer.phase("read"):
+            imei = _read_imei(probe)
+        if not imei:
+            raise CredError("IMEI does not look valid.", -5)
+    if erase:
+        with timer.phase("erase"):
+            probe.erase_all()
+    return imei
+
+
+def _build_delta_hex(app_hex, hashes, dirty=()):
+    """Return a hex file with the flash pages whose CRC32 doesn't match hashes, or that are in
+    dirty, and the number of those pages.
+
+    hashes maps page numbers to CRC32s. A page without one, such as a secure page that MODE_HASH
+    can't read, is always included. Each page is padded to its full size with the erased value.
+    Pages that the application doesn't use are compared with an erased page so that whatever was
+    left there is erased, as it would be by ERASE_ALL. Anything outside of flash (e.g. the UICR)
+    is always included.
+    """
+    used = _flash_pages(app_hex)
+    blank_page = bytes([BLANK_FLASH_VALUE]) * FLASH_PAGE_SIZE
+    delta_hex = HexImage()
+    pages = 0
+    for page in range(FLASH_PAGES):
+        addr = page * FLASH_PAGE_SIZE
+        data = app_hex.tobinstr(addr, addr + FLASH_PAGE_SIZE - 1) if page in used else blank_page
+        if page in dirty or zlib.crc32(data) != hashes.get(page):
+            delta_hex.puts(addr, data)
+            pages = pages + 1
+    for start, end in app_hex.segments():
+        if start >= FLASH_END_ADDR:
+            delta_hex.puts(start, app_hex.tobinstr(start, end - 1))
+    return (delta_hex, pages)
+
+
+def _program_app_delta(args, probe, stub_probe, intel_hex, timer, report):
+    """Hash the flash pages on the device with the stub and then only erase and program the
+    pages of --program_app that differ.
+
+    The stub is still in flash from provisioning and hashes itself along with everything else,
+    so the pages that it and the credential page were programmed to are always programmed too.
+    That also erases the credential page, which _provision left for this. The secure pages below
+    the stub can't be hashed and are always programmed as well.
+    """
+    result_code = _run_firmware(stub_probe, _build_mode_hex(intel_hex, MODE_HASH),
+                                DEFAULT_HASH_TIME_S, timer, wait=args.wait)
+    if result_code:
+        raise CredError("Firmware result is 0x{:X}".format(result_code), -4)
+    with timer.phase("read"):
+        data = bytes(stub_probe.read(PAGE_HASHES_ADDR, PAGE_HASHES_LEN))
+    start = struct.unpack_from('<I', data)[0]
+    if start % FLASH_PAGE_SIZE or start >= FLASH_END_ADDR:
+        raise CredError("Page hashes do not look valid.", -4)
+    first_page = start // FLASH_PAGE_SIZE
+    hashes = dict(zip(range(first_page, FLASH_PAGES),
+                      struct.unpack_from('<{}I'.format(FLASH_PAGES - first_page), data, 4)))
+    with timer.phase("app_program"):
+        delta_hex, pages = _build_delta_hex(HexImage.load(args.program_app), hashes,
+                                            stub_probe.pages)
+        report["app_pages"] = pages
+        if args.verbose:
+            print("app: {} of {} flash page(s) changed".format(pages, FLASH_PAGES),
+                  file=sys.stderr)
+        if len(delta_hex):
+            _program_hex(probe, delta_hex, _sector_erase(delta_hex))
+        else:
+            probe.reset()
+
+
+def _write_log(args, probe, intel_hex, timer, report, status, error):
+    """Append one JSON line describing this run to the log file."""
+    record = {"time": datetime.datetime.utcnow().isoformat() + "Z",
+              "probe": probe.serial_number if probe else None,
+              "imei": report.get("imei") or (report.get("mailbox") or {}).get("imei"),
+              "status": status,
+              "error": error,
+              "fw_result": report.get("fw_result"),
+              "skipped": report.get("skipped", False),
+              "app_pages": report.get("app_pages"),
+              "retries": report.get("retries", 0),
+              "fw_time_s": report.get("fw_time_s"),
+              "mailbox": report.get("mailbox"),
+              "phases_s": {name: round(seconds, 4) for name, seconds in timer.phases.items()},
+              "total_s": round(sum(timer.phases.values()), 4)}
+    if intel_hex is not None:
+        record["cred_count"] = len(_read_creds(intel_hex))
+        record["cred_bytes"] = intel_hex.maxaddr() + 1 - FIRST_CRED_ADDR
+        record["cred_digest"] = "0x{:08X}".format(_cred_digest(intel_hex))
+        record["hex_bytes"] = len(intel_hex)
+    with open(args.log, 'a') as log_file:
+        log_file.write(json.dumps(record, sort_keys=True) + "\n")
+
+
 def _main():
     """Append credentials to a prebuilt hex file, download it via a J-Link debug probe,
     allow the hex file to run, verify the result code, and then erase the hex file.
     """
     args = _add_and_parse_args()
-    nrfjprog_api = None
-    nrfjprog_probe = None
+    probe = None
+    intel_hex = None
+    timer = PhaseTimer()
+    report = {}
+    history = None
+    status = 0
+    error = None
     try:
-        hex_path = HEX_PATH
-        if args.in_file:
-            hex_path = args.in_file
-        intel_hex = IntelHex(hex_path)
-        if intel_hex.maxaddr() >= CRED_PAGE_ADDR:
-            if hex_path == HEX_PATH:
-                print("error: Prebuilt hex file is too large.")
-                _close_and_exit(nrfjprog_api, -3)
-            elif (intel_hex.maxaddr() < FW_RESULT_CODE_ADDR or
-                  intel_hex.gets(CRED_PAGE_ADDR, 4) != MAGIC_NUMBER_BYTES):
-                print("error: Magic number not found in hex file.")
-                _close_and_exit(nrfjprog_api, -2)
-        else:
-            intel_hex.puts(CRED_PAGE_ADDR, MAGIC_NUMBER_BYTES)
-            intel_hex.puts(CRED_COUNT_ADDR, struct.pack('B', 0x00))
-        if not args.out_file or args.program_app:
-            nrfjprog_api, nrfjprog_probe = _connect_to_jlink(args)
-        _append_creds(intel_hex, args)
+        with timer.phase("build"):
+            stub_hex, intel_hex = _build_hex(args)
+            if args.history:
+                history = _load_history(args.history)
         if args.out_file:
-            intel_hex.tofile(args.out_file, "hex")
-        else:
-            # Create a temporary file to pass to pynrfjprog and then delete it when finished.
-            tmp_file = os.path.sep.join((tempfile.mkdtemp(), TMP_FILE_NAME))
-            intel_hex.tofile(tmp_file, "hex")
-            _write_firmware(nrfjprog_probe, tmp_file)
-            time.sleep(args.fw_delay)
-            result_code = nrfjprog_probe.read(FW_RESULT_CODE_ADDR)
-            if result_code:
-                print("error: Firmware result is 0x{:X}".format(result_code))
-                _close_and_exit(nrfjprog_api, -4)
-            imei_bytes = nrfjprog_probe.read(IMEI_ADDR, IMEI_LEN + 1)
-            if (IMEI_LEN != imei_bytes.find(BLANK_FLASH_VALUE) or
-                    not imei_bytes[:IMEI_LEN].isdigit()):
-                print("error: IMEI does not look valid.")
-                _close_and_exit(nrfjprog_api, -5)
-            print(imei_bytes[:-1].decode())
-            nrfjprog_probe.erase(HighLevel.EraseAction.ERASE_ALL)
-            os.remove(tmp_file)
-            os.removedirs(os.path.dirname(tmp_file))
-        if args.program_app:
-            _write_firmware(nrfjprog_probe, args.program_app)
-
-        _close_and_exit(nrfjprog_api, 0)
+            _merge_stub(stub_hex, intel_hex).tofile(args.out_file, "hex")
+        if not args.out_file or args.program_app:
+            with timer.phase("connect"):
+                probe = _connect_to_probe(args, report)
+        if not args.out_file:
+            stub_probe = _stub_probe(args, probe, stub_hex)
+            report["imei"] = _provision(args, stub_probe, intel_hex, timer, report, history,
+                                        erase=not args.delta)
+            print(report["imei"])
+            if history is not None and "fw_time_s" in report:
+                _save_history(args.history, history, _cred_profile(intel_hex),
+                              report["fw_time_s"])
+        if args.delta:
+            _program_app_delta(args, probe, stub_probe, intel_hex, timer, report)
+        elif args.program_app:
+            with timer.phase("app_program"):
+                probe.program(args.program_app)
+    except CredError as ex:
+        status = ex.status
+        error = str(ex)
     except Exception as ex:
-        print("error: " + str(ex))
-        _close_and_exit(nrfjprog_api, -2)
+        status = -2
+        error = str(ex)
+    if error:
+        print("error: " + error)
+    if args.log:
+        _write_log(args, probe, intel_hex, timer, report, status, error)
+    _close_and_exit(probe, status)
 
 
 if __name__ == "__main__":
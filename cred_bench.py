@@ -0,0 +1,443 @@
+"""
+Benchmark the cred.py provisioning pipeline against the simulated nRF91 in cred_mock.py.
+
+Each scenario builds a representative credential set with the same code paths as the command
+line interface and then provisions it to a fresh MockProbe (i.e. a new board) a number of
+times. The time spent in each phase, the bytes moved over SWD, the flash pages erased, and the
+projected number of boards per hour are reported and can be saved as JSON. A previously saved
+file can be passed as a baseline to report the change in takt time per scenario.
+
+The absolute numbers are only as good as the timings in cred_mock.DEFAULT_OPTIONS (which can be
+overridden with --probe) but relative changes to the host pipeline show up directly. The
+scenarios program the stand-in stub from cred_mock.stub_hex() unless --stub_hex is given.
+
+--encoder runs a micro-benchmark of appending a full mTLS credential set to the prebuilt hex file
+instead, comparing the contiguous record encoder in cred.py with field-by-field puts() calls.
+
+--loader runs a micro-benchmark of loading application-sized hex files instead, comparing
+cred.HexImage, which keeps each contiguous segment in one bytearray, with IntelHex, which keeps a
+dict entry per byte. Each image is loaded and every segment read back out, as programming does.
+
+--stub reports the size of the firmware stub instead: the bytes and flash pages of the prebuilt
+hex file (what is programmed and verified on every board), the room left for it to grow, the RAM
+taken by zephyr.elf next to it, and the median kernel uptime at the first AT command (BOOT_MS)
+from the mailboxes in a cred.py --log file, which leaves out the bootloader and the SPM. Compared
+with a baseline, any of them growing by more than --budget percent is an error so that a stub
+change that slows down the line is caught.
+"""
+import argparse
+import base64
+import collections
+import json
+import os
+import shutil
+import statistics
+import struct
+import sys
+import tempfile
+import time
+
+try:
+    from intelhex import IntelHex
+except ImportError:
+    # Only required for --loader.
+    IntelHex = None
+
+import cred
+import cred_mock
+
+
+DEFAULT_RUNS = 3
+# Generous so that large credential sets don't time out; polling returns as soon as it's done.
+FW_DELAY_S = 60
+MANY_SEC_TAGS = 16
+ENCODER_RUNS = 50
+LOADER_RUNS = 3
+
+# The prebuilt firmware and typical --program_app sizes in bytes, each with a UICR segment.
+LOADER_SIZES = (0x2B000, 0x80000, 0xF0000)
+UICR_ADDR = 0xFF8000
+UICR_LEN = 0x100
+
+# Approximate sizes of real PEM bodies (before base64) in bytes.
+CA_CERT_LEN = 1000
+CLIENT_CERT_LEN = 900
+CLIENT_KEY_LEN = 140
+
+DEFAULT_BUDGET_PERCENT = 5.0
+ELF_NAME = "zephyr.elf"
+ELF_MAGIC = b'\x7fELF'
+ELF_CLASS_32 = 1
+SHF_ALLOC = 0x2
+
+
+def _write_pem(dir_path, name, label, length):
+    """Write a PEM file with a random body of the given length and return its path."""
+    body = base64.b64encode(os.urandom(length)).decode()
+    lines = [body[i:i + 64] for i in range(0, len(body), 64)]
+    path = os.path.join(dir_path, name)
+    with open(path, 'w') as out_file:
+        out_file.write("-----BEGIN {}-----\n".format(label))
+        out_file.write("\n".join(lines))
+        out_file.write("\n-----END {}-----\n".format(label))
+    return path
+
+
+def _scenarios(dir_path, stub_argv):
+    """Return a dict of scenario name -> list of argv lists (one per cred.py invocation), each
+    starting with stub_argv.
+    """
+    ca_cert = _write_pem(dir_path, "ca.crt", "CERTIFICATE", CA_CERT_LEN)
+    client_cert = _write_pem(dir_path, "client.crt", "CERTIFICATE", CLIENT_CERT_LEN)
+    client_key = _write_pem(dir_path, "client.key", "PRIVATE KEY", CLIENT_KEY_LEN)
+    psk = ["--psk_ident", "nrf-352656100000001", "--psk", "CAFEBABEDEADBEEF"]
+
+    many_tags = []
+    hex_path = None
+    for sec_tag in range(1, MANY_SEC_TAGS + 1):
+        argv = stub_argv + ["--sec_tag", str(sec_tag)] + psk
+        if hex_path:
+            argv = argv + ["-i", hex_path]
+        hex_path = os.path.join(dir_path, "many_{}.hex".format(sec_tag))
+        many_tags.append(argv + ["-o", hex_path])
+    many_tags[-1] = many_tags[-1][:-2]
+
+    return {
+        "psk": [stub_argv + ["--sec_tag", "1"] + psk],
+        "ca": [stub_argv + ["--sec_tag", "1", "--CA_cert", ca_cert]],
+        "mtls": [stub_argv + ["--sec_tag", "1", "--CA_cert", ca_cert, "--client_cert",
+                              client_cert, "--client_private_key", client_key]],
+        "many_sec_tags": many_tags,
+        "imei_only": [stub_argv + ["--imei_only"]],
+    }
+
+
+def _stub_argv(dir_path, stub_hex):
+    """Return the cred.py arguments that select the stub: stub_hex if given, otherwise the
+    stand-in from cred_mock written to dir_path, so the prebuilt hex file isn't needed.
+    """
+    if stub_hex is None:
+        stub_hex = os.path.join(dir_path, "stub.hex")
+        cred_mock.stub_hex().tofile(stub_hex, "hex")
+    return ["--stub_hex", stub_hex]
+
+
+def _run_scenario(invocations, probe_spec, extra_argv, runs):
+    """Provision the scenario on a fresh mock board for each run and return the results."""
+    # Earlier invocations only write hex files that the last one reads.
+    for argv in invocations[:-1]:
+        stub_hex, intel_hex = cred._build_hex(cred._add_and_parse_args(argv))
+        cred._merge_stub(stub_hex, intel_hex).tofile(argv[-1], "hex")
+    args = cred._add_and_parse_args(invocations[-1] + ["--fw_delay", str(FW_DELAY_S)] +
+                                    extra_argv)
+
+    results = []
+    for _ in range(runs):
+        timer = cred.PhaseTimer()
+        with timer.phase("build"):
+            stub_hex, intel_hex = cred._build_hex(args)
+        with timer.phase("connect"):
+            probe = cred_mock.MockProbe.from_spec(probe_spec)
+        cred._provision(args, cred._stub_probe(args, probe, stub_hex), intel_hex, timer)
+        probe.close()
+        total_s = sum(timer.phases.values())
+        results.append({"total_s": total_s,
+                        "phases_s": dict(timer.phases),
+                        "swd_bytes": probe.stats["bytes_written"] + probe.stats["bytes_read"],
+                        "swd_transactions": probe.stats["transactions"],
+                        "pages_erased": probe.stats["pages_erased"],
+                        "cred_bytes": intel_hex.maxaddr() + 1 - cred.FIRST_CRED_ADDR})
+    return results
+
+
+def _append_cred_by_field(intel_hex, sec_tag, cred_type, content):
+    """Append a credential one field at a time, as cred.py used to."""
+    if isinstance(content, str):
+        # IntelHex.puts() took strings as latin-1, HexImage.puts() only takes bytes.
+        content = content.encode('latin-1')
+    addr = (intel_hex.maxaddr() + 1)
+    intel_hex.puts(addr, struct.pack('I', sec_tag))
+    addr = addr + 4
+    intel_hex[addr] = cred_type
+    addr = addr + 1
+    intel_hex.puts(addr, struct.pack('H', len(content)))
+    addr = addr + 2
+    intel_hex.puts(addr, content)
+
+
+def _append_creds_by_field(intel_hex, creds):
+    """Append credentials one at a time, reading back the length each time."""
+    for sec_tag, cred_type, content in creds:
+        records_len = struct.unpack('<I', intel_hex.gets(cred.RECORDS_LEN_ADDR, 4))[0]
+        _append_cred_by_field(intel_hex, sec_tag, cred_type, content)
+        intel_hex.puts(cred.RECORDS_LEN_ADDR,
+                       struct.pack('<I', records_len + 7 + len(content)))
+
+
+def _bench_encoder(dir_path, stub_argv, runs):
+    """Time appending an mTLS credential set with both encoders and print the medians."""
+    _scenarios(dir_path, stub_argv)
+    # --imei_only builds the credential page without any credentials.
+    _, base_hex = cred._build_hex(cred._add_and_parse_args(stub_argv + ["--imei_only"]))
+    creds = [(1, cred_type, cred._read_key_material_from_file(os.path.join(dir_path, name)))
+             for name, cred_type in (("ca.crt", cred.CRED_TYPE_ROOT_CA),
+                                     ("client.crt", cred.CRED_TYPE_CLIENT_CERT),
+                                     ("client.key", cred.CRED_TYPE_CLIENT_PRIVATE_KEY))]
+    results = {}
+    hex_files = {}
+    for name, append in (("by_field", _append_creds_by_field),
+                         ("contiguous", cred._append_encoded_creds)):
+        times = []
+        for _ in range(runs):
+            intel_hex = base_hex[:]
+            start = time.perf_counter()
+            append(intel_hex, creds)
+            times.append(time.perf_counter() - start)
+        hex_files[name] = intel_hex
+        results[name] = statistics.median(times)
+        print("{:<14} {:>9.3f} ms".format(name, results[name] * 1000.0))
+    blobs = [intel_hex.gets(cred.MODE_ADDR, intel_hex.maxaddr() + 1 - cred.MODE_ADDR)
+             for intel_hex in hex_files.values()]
+    if blobs[0] != blobs[1]:
+        print("error: encoders produced different hex files")
+        sys.exit(-1)
+    print("{:<14} {:>9.1f}x".format("speedup", results["by_field"] / results["contiguous"]))
+
+
+def _load_segments(load, path):
+    """Load a hex file and return its segments as a list of (start, bytes)."""
+    intel_hex = load(path)
+    return [(start, intel_hex.tobinstr(start, end - 1)) for start, end in intel_hex.segments()]
+
+
+def _bench_loader(dir_path, runs):
+    """Time loading hex files of realistic sizes with both loaders and print the medians."""
+    if IntelHex is None:
+        print("error: intelhex is required to use --loader")
+        sys.exit(-1)
+    for size in LOADER_SIZES:
+        image = cred.HexImage()
+        image.puts(0, os.urandom(size))
+        image.puts(UICR_ADDR, os.urandom(UICR_LEN))
+        path = os.path.join(dir_path, "app_{}k.hex".format(size // 1024))
+        image.tofile(path, "hex")
+        results = {}
+        segments = {}
+        for name, load in (("IntelHex", IntelHex), ("HexImage", cred.HexImage.load)):
+            times = []
+            for _ in range(runs):
+                start = time.perf_counter()
+                segments[name] = _load_segments(load, path)
+                times.append(time.perf_counter() - start)
+            results[name] = statistics.median(times)
+        if segments["IntelHex"] != segments["HexImage"]:
+            print("error: loaders produced different segments")
+            sys.exit(-1)
+        print("{:>6} KiB  IntelHex {:>9.1f} ms  HexImage {:>7.1f} ms  {:>6.1f}x".format(
+            size // 1024, results["IntelHex"] * 1000.0, results["HexImage"] * 1000.0,
+            results["IntelHex"] / results["HexImage"]))
+
+
+def _elf_ram_bytes(path):
+    """Return the bytes of RAM taken by the allocated sections of a 32-bit ELF file."""
+    with open(path, 'rb') as elf_file:
+        data = elf_file.read()
+    if data[:4] != ELF_MAGIC or data[4] != ELF_CLASS_32:
+        raise ValueError("not a 32-bit ELF file ({})".format(path))
+    shoff = struct.unpack_from('<I', data, 32)[0]
+    shentsize, shnum = struct.unpack_from('<HH', data, 46)
+    ram_bytes = 0
+    for index in range(shnum):
+        _, _, flags, addr, _, size = struct.unpack_from('<6I', data, shoff + index * shentsize)
+        in_ram = cred_mock.RAM_ADDR <= addr < cred_mock.RAM_ADDR + cred_mock.RAM_SIZE
+        if flags & SHF_ALLOC and in_ram:
+            ram_bytes = ram_bytes + size
+    return ram_bytes
+
+
+def _log_boot_ms(path):
+    """Return the median BOOT_MS from the mailboxes in a cred.py log file or None."""
+    boot_ms = []
+    with open(path) as log_file:
+        for line in log_file:
+            mailbox = json.loads(line).get("mailbox") or {}
+            if mailbox.get("boot_ms") is not None:
+                boot_ms.append(mailbox["boot_ms"])
+    return statistics.median(boot_ms) if boot_ms else None
+
+
+def _stub_report(hex_path, log_path):
+    """Measure the firmware stub in a prebuilt hex file (see --stub)."""
+    intel_hex = cred.HexImage.load(hex_path)
+    # Leave out the UICR and anything else outside of flash.
+    segments = [(start, end) for start, end in intel_hex.segments()
+                if start < cred_mock.FLASH_SIZE]
+    pages = set()
+    for start, end in segments:
+        pages.update(range(start // cred_mock.FLASH_PAGE_SIZE,
+                           (end - 1) // cred_mock.FLASH_PAGE_SIZE + 1))
+    stub_end = max(end for _, end in segments) if segments else 0
+    # A stub with a locator has the credential page placed after it wherever it ends.
+    page_limit = cred.FLASH_END_ADDR if cred._find_locators(intel_hex) else cred.CRED_PAGE_ADDR
+    elf_path = os.path.join(os.path.dirname(hex_path), ELF_NAME)
+    report = collections.OrderedDict()
+    report["image_bytes"] = sum(end - start for start, end in segments)
+    report["flash_pages"] = len(pages)
+    report["headroom_bytes"] = page_limit - stub_end
+    report["ram_bytes"] = _elf_ram_bytes(elf_path) if os.path.isfile(elf_path) else None
+    report["kernel_boot_ms"] = _log_boot_ms(log_path) if log_path else None
+    return report
+
+
+def _check_stub(report, baseline, budget_percent):
+    """Print the stub report and return a list of budget violations."""
+    errors = []
+    if report["headroom_bytes"] < 0:
+        errors.append("stub overlaps the credential page")
+    for name, value in report.items():
+        if value is None:
+            continue
+        line = "{:<14} {:>9}".format(name, value)
+        previous = (baseline or {}).get(name)
+        if previous and name != "headroom_bytes":
+            change = 100.0 * (value - previous) / previous
+            line = line + " {:+6.1f}%".format(change)
+            if change > budget_percent:
+                errors.append("stub {} grew by {:.1f}% (budget {:.1f}%)".format(
+                    name, change, budget_percent))
+        print(line)
+    return errors
+
+
+def _summarize(results):
+    """Reduce the per-run results of a scenario to medians."""
+    total_s = statistics.median(result["total_s"] for result in results)
+    phases = {}
+    for result in results:
+        for name, seconds in result["phases_s"].items():
+            phases.setdefault(name, []).append(seconds)
+    return {"runs": len(results),
+            "total_s": total_s,
+            "boards_per_hour": (3600.0 / total_s) if total_s else 0.0,
+            "phases_s": {name: statistics.median(values) for name, values in phases.items()},
+            "swd_bytes": results[-1]["swd_bytes"],
+            "swd_transactions": results[-1]["swd_transactions"],
+            "pages_erased": results[-1]["pages_erased"],
+            "cred_bytes": results[-1]["cred_bytes"]}
+
+
+def _print_summary(name, summary, baseline):
+    """Print one scenario's summary and its change relative to the baseline."""
+    line = "{:<14} {:>7.3f} s {:>8.0f} boards/h {:>8} SWD bytes {:>4} pages".format(
+        name, summary["total_s"], summary["boards_per_hour"],
+        summary["swd_bytes"], summary["pages_erased"])
+    if baseline and name in baseline:
+        previous = baseline[name]["total_s"]
+        line = line + " {:+6.1f}%".format(100.0 * (summary["total_s"] - previous) / previous)
+    print(line)
+    print("{:<14} {}".format("", "  ".join("{} {:.3f}".format(phase, seconds)
+                                           for phase, seconds in summary["phases_s"].items())))
+
+
+def _main():
+    """Run the selected scenarios and report the results."""
+    parser = argparse.ArgumentParser(prog='cred_bench',
+                                     description=('Benchmark the cred.py provisioning ' +
+                                                  'pipeline against a simulated nRF91.'))
+    parser.add_argument("-n", "--runs", type=int, default=DEFAULT_RUNS,
+                        help="number of boards to provision per scenario")
+    parser.add_argument("--scenario", action='append', metavar="NAME",
+                        help="only run the named scenario (may be repeated)")
+    parser.add_argument("--probe", type=str, default="mock", metavar="PROBE",
+                        help="mock probe spec, e.g. 'mock:swd_kBps=1000,write_ms=250'")
+    parser.add_argument("--cred_args", type=str, default="", metavar="ARGS",
+                        help="extra cred.py arguments for every scenario, e.g. '--batch'")
+    parser.add_argument("-o", "--out_file", type=str, metavar="JSON_PATH",
+                        help="save the results as JSON")
+    parser.add_argument("-b", "--baseline", type=str, metavar="JSON_PATH",
+                        help="compare against results saved by a previous run")
+    parser.add_argument("--encoder", action='store_true',
+                        help="only run the credential record encoder micro-benchmark")
+    parser.add_argument("--loader", action='store_true',
+                        help="only run the hex file loader micro-benchmark")
+    parser.add_argument("--stub", action='store_true',
+                        help="only report the size of the firmware stub and its kernel boot " +
+                        "time")
+    parser.add_argument("--stub_hex", type=str, metavar="HEX_PATH",
+                        help="prebuilt hex file to provision with and for --stub (default: a " +
+                        "stand-in from cred_mock, and {} for --stub)".format(cred.HEX_PATH))
+    parser.add_argument("--stub_log", type=str, metavar="LOG_FILE_PATH",
+                        help="cred.py --log file to take the kernel boot time from for --stub")
+    parser.add_argument("--budget", type=float, default=DEFAULT_BUDGET_PERCENT,
+                        metavar="PERCENT",
+                        help="largest growth over the baseline allowed for --stub " +
+                        "(default: {})".format(DEFAULT_BUDGET_PERCENT))
+    args = parser.parse_args()
+
+    if args.encoder:
+        tmp_dir = tempfile.mkdtemp()
+        try:
+            _bench_encoder(tmp_dir, _stub_argv(tmp_dir, args.stub_hex),
+                           max(args.runs, ENCODER_RUNS))
+        except cred.CredError as ex:
+            print("error: " + str(ex))
+            sys.exit(ex.status)
+        finally:
+            shutil.rmtree(tmp_dir)
+        return
+
+    if args.loader:
+        tmp_dir = tempfile.mkdtemp()
+        try:
+            _bench_loader(tmp_dir, max(args.runs, LOADER_RUNS))
+        finally:
+            shutil.rmtree(tmp_dir)
+        return
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as in_file:
+            baseline = json.load(in_file)
+
+    if args.stub:
+        stub_hex = args.stub_hex or cred.HEX_PATH
+        report = {"stub_hex": stub_hex, "stub": _stub_report(stub_hex, args.stub_log)}
+        errors = _check_stub(report["stub"], (baseline or {}).get("stub"), args.budget)
+        if args.out_file:
+            with open(args.out_file, 'w') as out_file:
+                json.dump(report, out_file, indent=2, sort_keys=True)
+        for error in errors:
+            print("error: " + error)
+        if errors:
+            sys.exit(-1)
+        return
+    if baseline:
+        baseline = baseline.get("scenarios")
+
+    tmp_dir = tempfile.mkdtemp()
+    try:
+        scenarios = _scenarios(tmp_dir, _stub_argv(tmp_dir, args.stub_hex))
+        names = args.scenario or list(scenarios)
+        unknown = [name for name in names if name not in scenarios]
+        if unknown:
+            print("error: unknown scenario(s): {}".format(", ".join(unknown)))
+            sys.exit(-1)
+        report = {"probe": args.probe, "cred_args": args.cred_args, "scenarios": {}}
+        for name in names:
+            results = _run_scenario(scenarios[name], args.probe, args.cred_args.split(),
+                                    args.runs)
+            report["scenarios"][name] = _summarize(results)
+            _print_summary(name, report["scenarios"][name], baseline)
+    except cred.CredError as ex:
+        print("error: " + str(ex))
+        sys.exit(ex.status)
+    finally:
+        shutil.rmtree(tmp_dir)
+
+    if args.out_file:
+        with open(args.out_file, 'w') as out_file:
+            json.dump(report, out_file, indent=2, sort_keys=True)
+
+
+if __name__ == "__main__":
+    _main()
@@ -0,0 +1,661 @@
+"""
+In-memory debug probe and nRF91 simulation for running cred.py without hardware.
+
+MockProbe implements the same methods as cred.JLinkProbe. Flash and RAM are byte arrays and
+every probe transaction costs a configurable latency plus transfer time at a configurable SWD
+throughput. Programming a hex file resets the simulated nRF91, which then runs MockFirmware:
+a model of src/main.c that consumes the credential page and produces the same result code,
+IMEI, digest, mailbox, and AT%CMNG=1 listing. Each of those writes becomes visible at the time
+the real firmware would need to get that far, based on the configured timings. In MODE_STREAM
+the model instead reacts to what the host writes to the ring buffer channel in RAM. In
+MODE_UART it does the same with the frames that arrive on a pty, whose path is uart_port, and a
+thread keeps it going while the host isn't using the probe. In MODE_KEYGEN it generates a key
+and a CSR with the openssl command line tool, as AT%KEYGEN would, and then carries on as in
+MODE_STREAM. The simulated modem keeps its credentials across programming cycles, just like the
+real one. Like src/main.c, the model finds the credential page in flash through the stub's
+locator.
+
+Since the model never runs the stub itself, stub_hex() returns a stand-in for the prebuilt
+firmware: filler bytes with the same segments as build/zephyr/merged.hex and an unpatched
+locator. cred.py and cred_bench.py use it with the mock probe unless --stub_hex is given, so
+they don't depend on the prebuilt hex file being rebuilt from the current src/main.c.
+
+Failures can be injected to exercise cred.py's retries: probe transactions that raise, firmware
+runs that hang before writing a result, credential writes that fail, and UART frames whose
+record or length is corrupted on the way.
+
+Options are passed as a spec string, e.g. --probe mock:swd_kBps=1000,write_ms=250,cfun=1
+"""
+import base64
+import errno
+import hashlib
+import os
+import shutil
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+import tty
+import zlib
+
+import cred
+
+
+FLASH_SIZE = 0x100000
+FLASH_PAGE_SIZE = 0x1000
+UICR_ADDR = 0xFF8000
+UICR_SIZE = 0x1000
+RAM_ADDR = 0x20000000
+RAM_SIZE = 0x40000
+MAILBOX_ADDR = 0x2002F000
+DHCSR_C_DEBUGEN = (1 << 0)
+CHANNEL_ADDR = (MAILBOX_ADDR + 0x100)
+CHANNEL_UP_SIZE = 1024
+CHANNEL_DOWN_SIZE = 2048
+CHANNEL_UP_BUF = (CHANNEL_ADDR + cred.CHANNEL_LEN)
+CHANNEL_DOWN_BUF = (CHANNEL_UP_BUF + CHANNEL_UP_SIZE)
+MAILBOX_CHANNEL_OFFSET = 36
+UART_RX_SIZE = 4096
+FRAME_HEADER = struct.pack(cred.FRAME_HEADER_FORMAT, 0)
+FRAME_CRC = struct.pack(cred.FRAME_CRC_FORMAT, 0)
+UART_TICK_S = 0.001
+# What AT%KEYGEN generates: a P-256 key and a CSR with the IMEI as the subject.
+KEYGEN_COMMAND = [cred.OPENSSL, "req", "-new", "-newkey", "ec",
+                  "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes", "-outform", "DER"]
+
+DEFAULT_IMEI = "352656100000001"
+
+# The segments of build/zephyr/merged.hex: the secure partition manager and then the stub.
+STUB_SEGMENTS = ((0x0, 0x8000), (0xC000, 0x1E1EC))
+# Where the stub's image starts. Flash below it is secure and MODE_HASH doesn't read it.
+NS_FLASH_ADDR = STUB_SEGMENTS[-1][0]
+STUB_LOCATOR_ADDR = 0x1E000
+
+DEFAULT_OPTIONS = {
+    "swd_kBps": 500.0,          # effective SWD throughput in KiB/s
+    "latency_ms": 2.0,          # fixed cost of each probe transaction
+    "erase_ms": 90.0,           # ERASE_ALL
+    "page_erase_ms": 87.0,      # erasing one flash page with ERASE_SECTOR
+    "hash_ms": 300.0,           # MODE_HASH over the non-secure flash
+    "keygen_ms": 1500.0,        # AT%KEYGEN generating a key and its CSR
+    "boot_ms": 250.0,           # reset until main() starts
+    "at_ms": 15.0,              # each AT command round trip
+    "write_ms": 350.0,          # each credential written via modem_key_mgmt
+    "batch_write_ms": 250.0,    # each credential written through the batched AT socket
+    "modem_kBps": 16.0,         # additional modem time per KiB of credential content
+    "cfun": 0,                  # modem functional mode after reset
+    "fail_index": -1,           # credential write (from 0) that fails
+    "fail_code": 513,           # CME error returned by the failed write
+    "fail_runs": 1,             # number of firmware runs in which that write fails
+    "hang_runs": 0,             # number of firmware runs that hang before writing a result
+    "swd_fail_every": 0,        # every Nth probe transaction fails (0 never)
+    "corrupt_index": -1,        # UART frame (from 0) that arrives corrupted
+    "corrupt_len_index": -1,    # UART frame (from 0) whose length arrives corrupted
+    "corrupt_runs": 1,          # number of firmware runs in which that frame is corrupted
+    "imei": DEFAULT_IMEI,
+}
+
+
+class MockFirmware(object):
+    """Model of src/main.c that returns the memory writes it would make, with timestamps."""
+
+    def __init__(self, options):
+        self.options = options
+        self.modem = {}
+        self.hung = False
+        self.stream = None
+        self.cfun = int(options["cfun"])
+        self.fail_runs = int(options["fail_runs"])
+        self.hang_runs = int(options["hang_runs"])
+        self.corrupt_runs = int(options["corrupt_runs"])
+
+    def _write_time_s(self, length, batched):
+        per_write_ms = self.options["batch_write_ms" if batched else "write_ms"]
+        return (per_write_ms / 1000.0 +
+                length / (self.options["modem_kBps"] * 1024.0))
+
+    def run(self, memory):
+        """Return a list of (seconds after reset, address, bytes) writes, ending with the
+        breakpoint that halts the core unless the firmware hangs.
+        """
+        self.hung = False
+        self.stream = None
+        writes = self._run(memory)
+        if not self.hung and not self.stream:
+            writes.append((writes[-1][0], cred.DHCSR_ADDR,
+                           struct.pack('<I', DHCSR_C_DEBUGEN | cred.DHCSR_S_HALT)))
+        return writes
+
+    def _run(self, memory):
+        """Return the memory writes that src/main.c makes."""
+        if memory.gets(cred.CRED_PAGE_ADDR, 4) != cred.MAGIC_NUMBER_BYTES:
+            # Something other than the stub (e.g. the application) is running.
+            self.hung = True
+            return []
+        at_s = self.options["at_ms"] / 1000.0
+        now = self.options["boot_ms"] / 1000.0
+        writes = [(now, cred.MAILBOX_ADDR_ADDR, struct.pack('<I', MAILBOX_ADDR)),
+                  (now, MAILBOX_ADDR + cred.MAILBOX_LEN - 4, struct.pack('<I', int(now * 1000)))]
+        mode = memory.gets(cred.MODE_ADDR, 1)[0]
+        if mode == cred.MODE_HASH:
+            # Happens before the modem is touched.
+            now = now + self.options["hash_ms"] / 1000.0
+            flash = memory.flash
+            hashes = [zlib.crc32(flash[addr:addr + FLASH_PAGE_SIZE])
+                      for addr in range(NS_FLASH_ADDR, cred.FLASH_END_ADDR, FLASH_PAGE_SIZE)]
+            writes.append((now, cred.PAGE_HASHES_ADDR,
+                           struct.pack('<{}I'.format(len(hashes) + 1), NS_FLASH_ADDR, *hashes)))
+            writes.append((now, cred.FW_RESULT_CODE_ADDR, struct.pack('<i', 0)))
+            return writes
+
+        cfun_mode = 0xFF
+        cfun_changed = 0
+        cfun_start = now
+        if mode != cred.MODE_IMEI:
+            now = now + at_s
+            cfun_mode = self.cfun
+            if self.cfun not in (0, 4):
+                now = now + at_s
+                cfun_changed = 1
+                self.cfun = 0
+        cfun_ms = int((now - cfun_start) * 1000)
+
+        now = now + at_s
+        imei = self.options["imei"].encode()[:cred.IMEI_LEN]
+        writes.append((now, MAILBOX_ADDR,
+                       struct.pack('<I16sIBB', cred.MAILBOX_MAGIC, imei, cfun_ms,
+                                   cfun_mode, cfun_changed)))
+        if mode == cred.MODE_IMEI:
+            return writes
+        writes.append((now, cred.IMEI_ADDR, imei))
+
+        if memory.gets(cred.FW_RESULT_CODE_ADDR, 4) != b'\xff\xff\xff\xff':
+            return writes
+
+        if mode == cred.MODE_CHECK:
+            now = now + at_s
+            listing = "".join('%CMNG: {},{},"{}"\r\n'.format(sec_tag, cred_type, sha)
+                              for (sec_tag, cred_type), sha in sorted(self.modem.items()))
+            writes.append((now, cred.CHECK_LIST_ADDR, listing.encode() + b'\x00'))
+            writes.append((now, cred.FW_RESULT_CODE_ADDR, struct.pack('<i', 0)))
+            return writes
+
+        if self.hang_runs > 0:
+            self.hang_runs = self.hang_runs - 1
+            self.hung = True
+            return writes
+
+        if mode == cred.MODE_KEYGEN:
+            request = cred._read_creds(memory)
+            if len(request) != 1 or request[0][2]:
+                writes.append((now, cred.FW_RESULT_CODE_ADDR,
+                               struct.pack('<i', -errno.EBADMSG)))
+                return writes
+            sec_tag, key_type, _ = request[0]
+            now = now + self.options["keygen_ms"] / 1000.0
+            csr, key = self._keygen()
+            self.modem[(sec_tag, key_type)] = hashlib.sha256(key).hexdigest().upper()
+            writes.append((now, cred.CSR_ADDR,
+                           base64.urlsafe_b64encode(csr).rstrip(b'=') + b'\x00'))
+
+        if mode in (cred.MODE_STREAM, cred.MODE_UART, cred.MODE_KEYGEN):
+            # The rest happens in service() as the host streams the records.
+            framed = (mode == cred.MODE_UART)
+            self.stream = {"start": now,
+                           "busy_until": now,
+                           "received": b"",
+                           "index": 0,
+                           "written": 0,
+                           "result": 0,
+                           "crc": 0,
+                           "outbox": [],
+                           "framed": framed,
+                           "fd": memory.uart_fd if framed else None}
+            if framed:
+                line = "%READY: {}\n".format(UART_RX_SIZE - 1).encode()
+                self.stream["outbox"].append((now, line))
+            else:
+                writes.append((now, CHANNEL_ADDR, self._channel_block()))
+                writes.append((now, MAILBOX_ADDR + MAILBOX_CHANNEL_OFFSET,
+                               struct.pack('<I', CHANNEL_ADDR)))
+            return writes
+
+        if memory.gets(cred.RECORDS_LEN_ADDR, 4) == b'\xff\xff\xff\xff':
+            return writes
+
+        creds = cred._read_creds(memory)
+        if (sum(7 + len(content) for _, _, content in creds) !=
+                struct.unpack('<I', memory.gets(cred.RECORDS_LEN_ADDR, 4))[0]):
+            writes.append((now, cred.FW_RESULT_CODE_ADDR, struct.pack('<i', -errno.EBADMSG)))
+            return writes
+
+        batched = mode in (cred.MODE_WRITE_BATCHED, cred.MODE_WRITE_FRAGMENTED)
+        cred_start = now
+        if batched:
+            now = now + at_s
+        result = 0
+        written = 0
+        records_len = 0
+        for index, (sec_tag, cred_type, content) in enumerate(creds):
+            now = now + self._write_time_s(len(content), batched)
+            if index == self.options["fail_index"] and self.fail_runs > 0:
+                self.fail_runs = self.fail_runs - 1
+                result = self.options["fail_code"]
+                break
+            self.modem[(sec_tag, cred_type)] = hashlib.sha256(
+                cred._expand_imei(content, self.options["imei"])).hexdigest().upper()
+            written = written + 1
+            records_len = records_len + 7 + len(content)
+        writes.append((now, MAILBOX_ADDR + cred.MAILBOX_CFUN_OFFSET + 6,
+                       struct.pack('<HIB', written, int((now - cred_start) * 1000), batched)))
+        if not result:
+            digest = zlib.crc32(memory.gets(cred.FIRST_CRED_ADDR, records_len))
+            writes.append((now, cred.CRED_DIGEST_ADDR, struct.pack('<I', digest)))
+        writes.append((now, cred.FW_RESULT_CODE_ADDR, struct.pack('<i', result)))
+        return writes
+
+    def _keygen(self):
+        """Return a new CSR (DER) and private key (PEM) as the modem would generate them."""
+        tmp_dir = tempfile.mkdtemp()
+        key_path = os.path.join(tmp_dir, "key.pem")
+        try:
+            csr = subprocess.run(KEYGEN_COMMAND + ["-keyout", key_path,
+                                                   "-subj", "/CN=" + self.options["imei"]],
+                                 stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                                 check=True).stdout
+            with open(key_path, 'rb') as key_file:
+                return (csr, key_file.read())
+        finally:
+            shutil.rmtree(tmp_dir)
+
+    @staticmethod
+    def _channel_block():
+        """Return the ring buffer channel's control block as set up by channel_init()."""
+        return (cred.CHANNEL_ID.ljust(16, b'\x00') +
+                struct.pack('<ii', 1, 1) +
+                struct.pack('<6I', 0, CHANNEL_UP_BUF, CHANNEL_UP_SIZE, 0, 0, 0) +
+                struct.pack('<6I', 0, CHANNEL_DOWN_BUF, CHANNEL_DOWN_SIZE, 0, 0, 0))
+
+    @staticmethod
+    def _ring_read(memory, desc_addr):
+        """Take everything in a ring buffer, as the firmware does."""
+        buf_addr, size, wr_off, rd_off = struct.unpack('<4I', memory.gets(desc_addr + 4, 16))
+        if wr_off >= rd_off:
+            data = memory.gets(buf_addr + rd_off, wr_off - rd_off)
+        else:
+            data = memory.gets(buf_addr + rd_off, size - rd_off) + memory.gets(buf_addr, wr_off)
+        memory.poke(desc_addr + cred.RING_RD_OFF_OFFSET, struct.pack('<I', wr_off))
+        return data
+
+    @staticmethod
+    def _ring_write(memory, desc_addr, data):
+        """Put data in a ring buffer if there is room for all of it and return True if so."""
+        buf_addr, size, wr_off, rd_off = struct.unpack('<4I', memory.gets(desc_addr + 4, 16))
+        if (rd_off - wr_off - 1) % size < len(data):
+            return False
+        for value in data:
+            memory.poke(buf_addr + wr_off, bytes([value]))
+            wr_off = (wr_off + 1) % size
+        memory.poke(desc_addr + cred.RING_WR_OFF_OFFSET, struct.pack('<I', wr_off))
+        return True
+
+    def _stream_receive(self, memory):
+        """Take what the host has sent since the last call."""
+        if self.stream["fd"] is None:
+            return self._ring_read(memory, CHANNEL_ADDR + cred.CHANNEL_DOWN_OFFSET)
+        try:
+            return os.read(self.stream["fd"], UART_RX_SIZE)
+        except BlockingIOError:
+            return b""
+
+    def _stream_send(self, memory, line):
+        """Send a line to the host and return False if there is no room for it yet."""
+        if self.stream["fd"] is None:
+            return self._ring_write(memory, CHANNEL_ADDR + cred.CHANNEL_UP_OFFSET, line)
+        os.write(self.stream["fd"], line)
+        return True
+
+    def _stream_end(self, result):
+        """Finish the stream with the given result and return the writes that it makes."""
+        stream = self.stream
+        stream["result"] = stream["result"] or result
+        stream["received"] = b""
+        stream["done"] = stream["busy_until"]
+        line = "%DONE: {},{},{}\n".format(stream["result"], stream["index"], stream["crc"])
+        stream["outbox"].append((stream["done"], line.encode()))
+        return [(stream["done"], MAILBOX_ADDR + cred.MAILBOX_CFUN_OFFSET + 6,
+                 struct.pack('<HIB', stream["written"],
+                             int((stream["done"] - stream["start"]) * 1000), 0)),
+                (stream["done"], cred.FW_RESULT_CODE_ADDR, struct.pack('<i', stream["result"]))]
+
+    def service(self, memory, now):
+        """Advance MODE_STREAM or MODE_UART to the given time (seconds since reset).
+
+        Records are taken from the down buffer or the UART as soon as the host sends them, each
+        one takes the configured modem time, and the result lines go out once they are due.
+        Returns writes for when the stream ends.
+        """
+        stream = self.stream
+        if not stream:
+            return []
+        writes = []
+        framing = len(FRAME_HEADER) if stream["framed"] else 0
+        trailer = len(FRAME_CRC) if stream["framed"] else 0
+        if now >= stream["start"]:
+            stream["received"] = stream["received"] + self._stream_receive(memory)
+        while len(stream["received"]) >= framing + 7 and "done" not in stream:
+            received = stream["received"]
+            sec_tag, cred_type, length = struct.unpack('<IBH', received[framing:framing + 7])
+            frame_len = struct.unpack('<H', received[:framing])[0] if framing else 0
+            if stream["index"] == self.options["corrupt_len_index"] and self.corrupt_runs > 0:
+                self.corrupt_runs = self.corrupt_runs - 1
+                frame_len = frame_len ^ 0x01
+            if framing and frame_len != 7 + length:
+                writes.extend(self._stream_end(-errno.EBADMSG))
+                break
+            if sec_tag == 0xFFFFFFFF:
+                writes.extend(self._stream_end(0))
+                break
+            if len(received) < framing + 7 + length + trailer:
+                break
+            record = received[framing:framing + 7 + length]
+            frame_crc = received[framing + 7 + length:framing + 7 + length + trailer]
+            stream["received"] = received[framing + 7 + length + trailer:]
+            if stream["index"] == self.options["corrupt_index"] and self.corrupt_runs > 0:
+                self.corrupt_runs = self.corrupt_runs - 1
+                record = record[:-1] + bytes([record[-1] ^ 0x01])
+            stream["crc"] = zlib.crc32(record, stream["crc"])
+            result = 0
+            if framing and struct.unpack('<I', frame_crc)[0] != zlib.crc32(record):
+                result = -errno.EBADMSG
+            else:
+                stream["busy_until"] = (max(stream["busy_until"], now) +
+                                        self._write_time_s(length, False))
+                if stream["index"] == self.options["fail_index"] and self.fail_runs > 0:
+                    self.fail_runs = self.fail_runs - 1
+                    result = self.options["fail_code"]
+                else:
+                    self.modem[(sec_tag, cred_type)] = hashlib.sha256(
+                        cred._expand_imei(record[7:], self.options["imei"])).hexdigest().upper()
+                    stream["written"] = stream["written"] + 1
+            stream["result"] = stream["result"] or result
+            line = "%CRED: {},{}\n".format(stream["index"], result)
+            stream["outbox"].append((stream["busy_until"], line.encode()))
+            stream["index"] = stream["index"] + 1
+        while stream["outbox"] and stream["outbox"][0][0] <= now:
+            if not self._stream_send(memory, stream["outbox"][0][1]):
+                break
+            stream["outbox"].pop(0)
+        if "done" in stream and not stream["outbox"]:
+            self.stream = None
+            writes.append((now, cred.DHCSR_ADDR,
+                           struct.pack('<I', DHCSR_C_DEBUGEN | cred.DHCSR_S_HALT)))
+        return writes
+
+
+class FirmwareView(object):
+    """Memory as seen by MockFirmware, with the credential page wherever the stub keeps it."""
+
+    def __init__(self, probe, page_addr, page_size):
+        self._probe = probe
+        self._page_addr = page_addr
+        self._page_size = page_size
+
+    def addr(self, addr):
+        """Translate an address in the credential page."""
+        if cred.CRED_PAGE_ADDR <= addr < cred.CRED_PAGE_ADDR + self._page_size:
+            return addr - cred.CRED_PAGE_ADDR + self._page_addr
+        return addr
+
+    def gets(self, addr, length):
+        """Read memory."""
+        return self._probe.gets(self.addr(addr), length)
+
+    def poke(self, addr, data):
+        """Write memory."""
+        self._probe.poke(self.addr(addr), data)
+
+    @property
+    def uart_fd(self):
+        """Device side of the UART pty."""
+        return self._probe.uart_fd
+
+    @property
+    def flash(self):
+        """All of flash, wherever the credential page is."""
+        return self._probe.flash
+
+
+class MockProbe(object):
+    """Debug probe backend that simulates an nRF91 in memory."""
+
+    def __init__(self, **options):
+        self.options = dict(DEFAULT_OPTIONS)
+        self.options.update(options)
+        self.flash = bytearray(b'\xff') * FLASH_SIZE
+        self.uicr = bytearray(b'\xff') * UICR_SIZE
+        self.ram = bytearray(RAM_SIZE)
+        self.dhcsr = bytearray(struct.pack('<I', DHCSR_C_DEBUGEN))
+        self.firmware = MockFirmware(self.options)
+        self.serial_number = "mock"
+        self.stats = {"transactions": 0,
+                      "bytes_written": 0,
+                      "bytes_read": 0,
+                      "pages_erased": 0,
+                      "swd_s": 0.0}
+        self._pending = []
+        self._lock = threading.RLock()
+        self._uart = None
+        self._view = FirmwareView(self, cred.CRED_PAGE_ADDR, FLASH_SIZE - cred.CRED_PAGE_ADDR)
+
+    @classmethod
+    def from_spec(cls, spec):
+        """Create a MockProbe from a 'mock:option=value,...' string."""
+        options = {}
+        _, _, params = spec.partition(":")
+        for param in filter(None, params.split(",")):
+            key, _, value = param.partition("=")
+            if key not in DEFAULT_OPTIONS:
+                raise Exception("Unknown mock probe option ({})".format(key))
+            options[key] = type(DEFAULT_OPTIONS[key])(value)
+        return cls(**options)
+
+    def _transaction(self, num_bytes):
+        """Account for, and spend, the time that a probe transaction takes."""
+        cost_s = (self.options["latency_ms"] / 1000.0 +
+                  num_bytes / (self.options["swd_kBps"] * 1024.0))
+        self.stats["transactions"] = self.stats["transactions"] + 1
+        self.stats["swd_s"] = self.stats["swd_s"] + cost_s
+        time.sleep(cost_s)
+        fail_every = self.options["swd_fail_every"]
+        if fail_every and self.stats["transactions"] % fail_every == 0:
+            raise Exception("Mock probe transaction {} failed".format(self.stats["transactions"]))
+
+    def _region(self, addr, length):
+        """Return the backing buffer and offset for an address range."""
+        if addr + length <= FLASH_SIZE:
+            return (self.flash, addr)
+        if UICR_ADDR <= addr and addr + length <= UICR_ADDR + UICR_SIZE:
+            return (self.uicr, addr - UICR_ADDR)
+        if RAM_ADDR <= addr and addr + length <= RAM_ADDR + RAM_SIZE:
+            return (self.ram, addr - RAM_ADDR)
+        if addr == cred.DHCSR_ADDR and length <= len(self.dhcsr):
+            return (self.dhcsr, 0)
+        raise Exception("Mock probe access out of range (0x{:X})".format(addr))
+
+    def _write(self, addr, data):
+        """Write to memory. Flash and UICR writes can only clear bits."""
+        buf, offset = self._region(addr, len(data))
+        if buf is self.flash or buf is self.uicr:
+            for i, value in enumerate(data):
+                buf[offset + i] &= value
+        else:
+            buf[offset:offset + len(data)] = data
+
+    def _apply_pending(self):
+        """Make the firmware's writes visible once enough time has passed."""
+        with self._lock:
+            now = time.monotonic()
+            while self._pending and self._pending[0][0] <= now:
+                _, addr, data = self._pending.pop(0)
+                self._write(addr, data)
+            if self.firmware.stream:
+                self._schedule(self.firmware.service(self._view, now - self._reset_time))
+
+    def _schedule(self, writes):
+        """Queue the firmware's (seconds after reset, address, bytes) writes."""
+        self._pending.extend((self._reset_time + delay_s, self._view.addr(addr), data)
+                             for delay_s, addr, data in writes)
+        self._pending.sort(key=lambda write: write[0])
+
+    def _flash_page(self):
+        """Return the address of the credential page from the locator of the stub in flash."""
+        index = self.flash.find(cred.LOCATOR_MAGIC_BYTES)
+        while index >= 0:
+            if index % 4 == 0:
+                page_addr = struct.unpack_from('<I', self.flash, index + 4)[0]
+                return page_addr if page_addr < FLASH_SIZE else cred.CRED_PAGE_ADDR
+            index = self.flash.find(cred.LOCATOR_MAGIC_BYTES, index + 1)
+        return cred.CRED_PAGE_ADDR
+
+    def _start_firmware(self, page_addr, page_size):
+        """Start the firmware model with the credential page at the given address."""
+        with self._lock:
+            self._reset_time = time.monotonic()
+            self._view = FirmwareView(self, page_addr, page_size)
+            self._pending = []
+            self._schedule(self.firmware.run(self._view))
+        stream = self.firmware.stream
+        if stream and stream["framed"]:
+            threading.Thread(target=self._tick, args=(stream,), daemon=True).start()
+
+    def _tick(self, stream):
+        """Keep a MODE_UART run going until it ends or the device is reset."""
+        while self.firmware.stream is stream:
+            self._apply_pending()
+            time.sleep(UART_TICK_S)
+
+    @property
+    def uart_port(self):
+        """Path of the pty that stands in for the serial port connected to UART_0."""
+        if self._uart is None:
+            master, slave = os.openpty()
+            tty.setraw(slave)
+            os.set_blocking(master, False)
+            self._uart = (master, slave)
+        return os.ttyname(self._uart[1])
+
+    @property
+    def uart_fd(self):
+        """Device side of the pty."""
+        self.uart_port
+        return self._uart[0]
+
+    def poke(self, addr, data):
+        """Write memory without going through the probe (used by MockFirmware)."""
+        self._write(addr, data)
+
+    def gets(self, addr, length):
+        """Read memory without going through the probe (used by MockFirmware)."""
+        buf, offset = self._region(addr, length)
+        return bytes(buf[offset:offset + length])
+
+    def program(self, hex_path, erase=cred.ERASE_ALL):
+        """Erase everything (or only the pages in the hex file, and the UICR with
+        ERASE_SECTOR_AND_UICR), then program, verify, and reset.
+        """
+        intel_hex = cred.HexImage.load(hex_path)
+        if erase == cred.ERASE_ALL:
+            self.erase_all()
+        else:
+            self._erase_pages(intel_hex)
+            if erase == cred.ERASE_SECTOR_AND_UICR:
+                self.uicr[:] = b'\xff' * UICR_SIZE
+            elif any(start >= FLASH_SIZE for start, _ in intel_hex.segments()):
+                # As with nrfjprog, the UICR can't be programmed without erasing it.
+                raise Exception("Mock probe can't program the UICR with {}".format(erase))
+        for start, end in intel_hex.segments():
+            data = intel_hex.gets(start, end - start)
+            self._write(start, data)
+            self._transaction(len(data))
+            self.stats["bytes_written"] = self.stats["bytes_written"] + len(data)
+            # VERIFY_READ reads everything back.
+            self._transaction(len(data))
+            self.stats["bytes_read"] = self.stats["bytes_read"] + len(data)
+        self.reset()
+
+    def reset(self):
+        """Reset the simulated nRF91 and start the firmware."""
+        self._transaction(0)
+        self.dhcsr[:] = struct.pack('<I', DHCSR_C_DEBUGEN)
+        with self._lock:
+            self.ram[:] = bytes(RAM_SIZE)
+            self.firmware.stream = None
+        page_addr = self._flash_page()
+        self._start_firmware(page_addr, FLASH_SIZE - page_addr)
+
+    def read(self, addr, length=None):
+        """Read a word as an int or a number of bytes."""
+        self._apply_pending()
+        self._transaction(4 if length is None else length)
+        if length is None:
+            self.stats["bytes_read"] = self.stats["bytes_read"] + 4
+            return struct.unpack('<I', self.gets(addr, 4))[0]
+        self.stats["bytes_read"] = self.stats["bytes_read"] + length
+        return self.gets(addr, length)
+
+    def write(self, addr, data):
+        """Write bytes to RAM."""
+        self._apply_pending()
+        buf, _ = self._region(addr, len(data))
+        if buf is not self.ram:
+            raise Exception("Mock probe can only write to RAM (0x{:X})".format(addr))
+        self._transaction(len(data))
+        self.stats["bytes_written"] = self.stats["bytes_written"] + len(data)
+        self._write(addr, bytes(data))
+        self._apply_pending()
+
+    def _erase_pages(self, intel_hex):
+        """Erase the flash pages that the hex file uses."""
+        pages = set()
+        for start, end in intel_hex.segments():
+            pages.update(range(start - start % FLASH_PAGE_SIZE, min(end, FLASH_SIZE),
+                               FLASH_PAGE_SIZE))
+        for page in sorted(pages):
+            if self.flash[page:page + FLASH_PAGE_SIZE].count(0xFF) != FLASH_PAGE_SIZE:
+                self.stats["pages_erased"] = self.stats["pages_erased"] + 1
+            self.flash[page:page + FLASH_PAGE_SIZE] = b'\xff' * FLASH_PAGE_SIZE
+            self._transaction(0)
+            time.sleep(self.options["page_erase_ms"] / 1000.0)
+
+    def erase_all(self):
+        """Erase all of the flash and the UICR."""
+        for page in range(0, FLASH_SIZE, FLASH_PAGE_SIZE):
+            if self.flash[page:page + FLASH_PAGE_SIZE].count(0xFF) != FLASH_PAGE_SIZE:
+                self.stats["pages_erased"] = self.stats["pages_erased"] + 1
+        with self._lock:
+            self.flash[:] = b'\xff' * FLASH_SIZE
+            self.uicr[:] = b'\xff' * UICR_SIZE
+            self._pending = []
+            self.firmware.stream = None
+        self._transaction(0)
+        time.sleep(self.options["erase_ms"] / 1000.0)
+
+    def close(self):
+        """Stop the firmware and close the pty if it was opened."""
+        self.firmware.stream = None
+        if self._uart is not None:
+            os.close(self._uart[0])
+            os.close(self._uart[1])
+            self._uart = None
+
+
+def stub_hex():
+    """Return a stand-in for the prebuilt firmware (see STUB_SEGMENTS) with an unpatched locator."""
+    image = cred.HexImage()
+    for start, end in STUB_SEGMENTS:
+        image.puts(start, bytes(addr & 0xFF for addr in range(start, end)))
+    image.puts(STUB_LOCATOR_ADDR,
+               cred.LOCATOR_MAGIC_BYTES + struct.pack('<I', cred.CRED_PAGE_ADDR))
+    return image
@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/*
+ * Host simulator for the credential firmware.
+ *
+ *  src/main.c is compiled unmodified against the stand-ins in sim/include and run in its own
+ *  thread. The credential page of a hex file produced by cred.py is loaded into simulated
+ *  flash at its real address and the driver then polls the result code and the mailbox the
+ *  same way cred.py does over SWD. Each run happens in a forked child so the firmware's
+ *  statics start out zeroed, just like after a reset.
+ *
+ *  With -s the records are streamed to the firmware through its ring buffer channel in
+ *  MODE_STREAM instead of being read from flash, the same way cred.py --transport rtt does.
+ *  With -u they are sent as frames over a pty that stands in for UART_0 in MODE_UART, the same
+ *  way cred.py --transport uart does. A hex file in MODE_KEYGEN is run with -s as well, but
+ *  its record is the key request, so nothing is streamed and the CSR is left on the page (see
+ *  -o).
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/crc.h>
+
+#include "sim.h"
+
+
+#define DEFAULT_TIMEOUT_MS  10000
+#define DEFAULT_IMEI        "352656100000001"
+#define POLL_INTERVAL_US    100
+#define DUMP_LEN            0x2000
+#define STREAM_LINE_LEN     128
+#define FRAME_LEN_LEN       2
+#define FRAME_CRC_LEN       4
+
+struct sim_run {
+    int   status;
+    u32_t result;
+    u32_t digest;
+    u32_t cred_bytes;
+    u32_t modem_writes;
+    u64_t elapsed_us;
+    struct sim_mailbox mailbox;
+};
+
+/* Host side of a MODE_STREAM or MODE_UART run. */
+struct sim_stream {
+    u8_t  *data;
+    u32_t len;
+    u32_t sent;
+    u32_t *ends;
+    u32_t records;
+    u32_t acked;
+    u32_t window;
+    int   fd;
+    char  line[STREAM_LINE_LEN];
+    u32_t line_len;
+    bool  done;
+    u32_t crc;
+};
+
+struct sim_config sim_config = {
+    .fail_index = -1,
+    .cfun_mode = 0,
+    .imei = DEFAULT_IMEI,
+};
+
+extern void stub_main(void);
+
+
+static u64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Returns where the credential page is in a flash image: the address in the first locator
+ * (see src/main.c) that points at a page starting with MAGIC_NUMBER, or CRED_PAGE_ADDR.
+ */
+static u32_t find_page(const u8_t *image)
+{
+    for (u32_t addr = 0; addr + 8 <= FLASH_END_ADDR; addr += 4)
+    {
+        u32_t magic;
+        u32_t page_addr;
+
+        memcpy(&magic, image + addr, sizeof(magic));
+        if (LOCATOR_MAGIC != magic)
+        {
+            continue;
+        }
+        memcpy(&page_addr, image + addr + 4, sizeof(page_addr));
+        if (0 == (page_addr & (FLASH_PAGE_SIZE - 1)) && page_addr < FLASH_END_ADDR)
+        {
+            memcpy(&magic, image + page_addr, sizeof(magic));
+            if (MAGIC_NUMBER == magic)
+            {
+                return page_addr;
+            }
+        }
+    }
+    return CRED_PAGE_ADDR;
+}
+
+/* Loads the hex file into a scratch copy of flash and then copies everything from the
+ * credential page onwards into the simulated flash, where the firmware expects the page to be.
+ */
+int sim_hex_load(const char *path)
+{
+    static u8_t image[FLASH_END_ADDR];
+    char line[600];
+    u8_t rec[256 + 5];
+    u32_t base = 0;
+    u32_t page_addr;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    memset(image, 0xFF, sizeof(image));
+    while (fgets(line, sizeof(line), f))
+    {
+        size_t len = strcspn(line, "\r\n");
+        size_t count;
+        u32_t addr;
+
+        if (len < 11 || ':' != line[0] || 0 == (len & 1))
+        {
+            continue;
+        }
+        count = (len - 1) / 2;
+        for (size_t i = 0; i < count; i++)
+        {
+            int hi = hex_nibble(line[1 + i * 2]);
+            int lo = hex_nibble(line[2 + i * 2]);
+
+            if (hi < 0 || lo < 0)
+            {
+                fprintf(stderr, "%s: invalid record\n", path);
+                fclose(f);
+                return -1;
+            }
+            rec[i] = (hi << 4) | lo;
+        }
+        if (count != (size_t)rec[0] + 5)
+        {
+            fprintf(stderr, "%s: invalid record length\n", path);
+            fclose(f);
+            return -1;
+        }
+
+        addr = base + ((rec[1] << 8) | rec[2]);
+        switch (rec[3])
+        {
+        case 0x00:
+            for (u32_t i = 0; i < rec[0]; i++)
+            {
+                if (addr + i < FLASH_END_ADDR)
+                {
+                    image[addr + i] = rec[4 + i];
+                }
+            }
+            break;
+        case 0x02:
+            base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x04:
+            base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        default:
+            break;
+        }
+    }
+    fclose(f);
+
+    page_addr = find_page(image);
+    memcpy(sim_flash_ptr(CRED_PAGE_ADDR), image + page_addr, FLASH_END_ADDR - page_addr);
+    return 0;
+}
+
+static void *stub_thread(void *arg)
+{
+    /* main() never returns so make sure the child can still exit cleanly. */
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    stub_main();
+    return NULL;
+}
+
+static const volatile struct sim_mailbox *mailbox_ptr(void)
+{
+    u32_t addr = sim_flash_word(MAILBOX_ADDR_ADDR);
+
+    if (BLANK_WORD == addr)
+    {
+        return NULL;
+    }
+    return (const volatile struct sim_mailbox *)(uintptr_t)addr;
+}
+
+static bool run_done(u8_t mode)
+{
+    const volatile struct sim_mailbox *mailbox;
+
+    if (sim_core_debug.DHCSR & CoreDebug_DHCSR_S_HALT_Msk)
+    {
+        return true;
+    }
+    if (MODE_IMEI != mode)
+    {
+        return BLANK_WORD != sim_flash_word(FW_RESULT_CODE_ADDR);
+    }
+    mailbox = mailbox_ptr();
+    return mailbox && MAILBOX_MAGIC == mailbox->magic;
+}
+
+static u32_t cred_bytes(void)
+{
+    u32_t records_len = sim_flash_word(RECORDS_LEN_ADDR);
+
+    return (BLANK_WORD == records_len) ? 0 : records_len;
+}
+
+static void stream_add(struct sim_stream *stream, const u8_t *record, u16_t len, bool framed)
+{
+    u8_t *dst = &stream->data[stream->len];
+
+    if (framed)
+    {
+        u32_t crc = crc32_ieee(record, len);
+
+        memcpy(dst, &len, FRAME_LEN_LEN);
+        memcpy(&dst[FRAME_LEN_LEN], record, len);
+        memcpy(&dst[FRAME_LEN_LEN + len], &crc, FRAME_CRC_LEN);
+        len += FRAME_LEN_LEN + FRAME_CRC_LEN;
+    }
+    else
+    {
+        memcpy(dst, record, len);
+    }
+    stream->len += len;
+    stream->ends[stream->records++] = stream->len;
+}
+
+static void stream_start(struct sim_stream *stream, u32_t records_len, bool framed)
+{
+    const u8_t end[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00 };
+    const u8_t *records = sim_flash_ptr(FIRST_CRED_ADDR);
+    bool keygen = (MODE_KEYGEN == *sim_flash_ptr(MODE_ADDR));
+    u32_t max_records;
+    u16_t len;
+
+    if (keygen)
+    {
+        records_len = 0;
+    }
+    max_records = records_len / sizeof(end) + 1;
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = -1;
+    stream->data = malloc(records_len + sizeof(end) +
+                          max_records * (FRAME_LEN_LEN + FRAME_CRC_LEN));
+    stream->ends = malloc(max_records * sizeof(*stream->ends));
+    for (u32_t offset = 0; offset + sizeof(end) <= records_len; offset += sizeof(end) + len)
+    {
+        memcpy(&len, &records[offset + sizeof(end) - sizeof(len)], sizeof(len));
+        stream_add(stream, &records[offset], sizeof(end) + len, framed);
+    }
+    stream_add(stream, end, sizeof(end), framed);
+
+    /* In MODE_UART nothing is sent until the firmware announces its buffer. */
+    stream->window = framed ? 0 : stream->len;
+    if (!keygen)
+    {
+        *sim_flash_ptr(MODE_ADDR) = framed ? MODE_UART : MODE_STREAM;
+    }
+}
+
+static u32_t stream_limit(const struct sim_stream *stream)
+{
+    u32_t acked_end = stream->acked ? stream->ends[stream->acked - 1] : 0;
+    u32_t limit;
+
+    if (!stream->window)
+    {
+        return 0;
+    }
+
+    /* The first record that hasn't been answered can always be sent in full since the
+     * firmware is receiving it.
+     */
+    limit = acked_end + stream->window;
+    if (limit < stream->ends[MIN(stream->acked, stream->records - 1)])
+    {
+        limit = stream->ends[MIN(stream->acked, stream->records - 1)];
+    }
+    return MIN(limit, stream->len);
+}
+
+static void stream_line(struct sim_stream *stream)
+{
+    int result;
+    u32_t index;
+    u32_t count;
+
+    stream->line[stream->line_len] = '\0';
+    if (3 == sscanf(stream->line, "%%DONE: %d,%u,%u", &result, &count, &stream->crc))
+    {
+        stream->done = true;
+    }
+    else if (2 == sscanf(stream->line, "%%CRED: %u,%d", &index, &result))
+    {
+        stream->acked = index + 1;
+    }
+    else
+    {
+        sscanf(stream->line, "%%READY: %u", &stream->window);
+    }
+    stream->line_len = 0;
+}
+
+static void stream_char(struct sim_stream *stream, char c)
+{
+    if ('\n' == c || stream->line_len == STREAM_LINE_LEN - 1)
+    {
+        stream_line(stream);
+    }
+    else
+    {
+        stream->line[stream->line_len++] = c;
+    }
+}
+
+static void stream_service(struct sim_stream *stream)
+{
+    const volatile struct sim_mailbox *mailbox = mailbox_ptr();
+    struct sim_channel *channel;
+    struct sim_ring *ring;
+
+    if (!mailbox || !mailbox->channel_addr)
+    {
+        return;
+    }
+    channel = (struct sim_channel *)(uintptr_t)mailbox->channel_addr;
+
+    ring = &channel->down;
+    while (stream->sent < stream->len && ((ring->wr_off + 1) % ring->size) != ring->rd_off)
+    {
+        ((u8_t *)(uintptr_t)ring->buf)[ring->wr_off] = stream->data[stream->sent++];
+        __sync_synchronize();
+        ring->wr_off = (ring->wr_off + 1) % ring->size;
+    }
+
+    ring = &channel->up;
+    while (ring->rd_off != ring->wr_off)
+    {
+        char c = ((u8_t *)(uintptr_t)ring->buf)[ring->rd_off];
+
+        __sync_synchronize();
+        ring->rd_off = (ring->rd_off + 1) % ring->size;
+        stream_char(stream, c);
+    }
+}
+
+static void uart_service(struct sim_stream *stream)
+{
+    u32_t limit = stream_limit(stream);
+    char buf[256];
+    ssize_t len;
+
+    if (stream->sent < limit)
+    {
+        len = write(stream->fd, &stream->data[stream->sent], limit - stream->sent);
+        if (len > 0)
+        {
+            stream->sent += len;
+        }
+    }
+
+    while ((len = read(stream->fd, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t i = 0; i < len; i++)
+        {
+            stream_char(stream, buf[i]);
+        }
+    }
+}
+
+static void dump_flash(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (!f || 1 != fwrite(sim_flash_ptr(CRED_PAGE_ADDR), DUMP_LEN, 1, f))
+    {
+        perror(path);
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+}
+
+static void run_once(const char *hex_path, const char *modem_hex_path, const char *dump_path,
+                     u32_t timeout_ms, struct sim_run *run)
+{
+    const volatile struct sim_mailbox *mailbox;
+    struct sim_stream stream;
+    pthread_t thread;
+    u64_t deadline;
+    u8_t mode;
+
+    memset(run, 0, sizeof(*run));
+    run->status = -1;
+    if (sim_flash_init())
+    {
+        return;
+    }
+
+    sim_modem_reset();
+    if (modem_hex_path && sim_modem_preload(modem_hex_path))
+    {
+        return;
+    }
+    if (sim_hex_load(hex_path))
+    {
+        return;
+    }
+    run->cred_bytes = cred_bytes();
+    if (sim_config.stream || sim_config.uart)
+    {
+        stream_start(&stream, run->cred_bytes, sim_config.uart);
+    }
+    if (sim_config.uart)
+    {
+        const char *path = sim_uart_open();
+
+        stream.fd = path ? open(path, O_RDWR | O_NOCTTY | O_NONBLOCK) : -1;
+        if (stream.fd < 0)
+        {
+            perror("pty");
+            return;
+        }
+    }
+    mode = *sim_flash_ptr(MODE_ADDR);
+
+    run->elapsed_us = now_us();
+    deadline = run->elapsed_us + (u64_t)timeout_ms * 1000;
+    sim_kernel_boot();
+    pthread_create(&thread, NULL, stub_thread, NULL);
+    while (!run_done(mode) && now_us() < deadline)
+    {
+        if (sim_config.stream)
+        {
+            stream_service(&stream);
+        }
+        else if (sim_config.uart)
+        {
+            uart_service(&stream);
+        }
+        usleep(POLL_INTERVAL_US);
+    }
+    run->elapsed_us = now_us() - run->elapsed_us;
+    pthread_cancel(thread);
+
+    run->status = run_done(mode) ? 0 : -1;
+    run->result = sim_flash_word(FW_RESULT_CODE_ADDR);
+    run->digest = sim_flash_word(CRED_DIGEST_ADDR);
+    if (sim_config.stream || sim_config.uart)
+    {
+        /* Nothing is written to flash so report the CRC from the channel instead. */
+        if (sim_config.stream)
+        {
+            stream_service(&stream);
+        }
+        else
+        {
+            uart_service(&stream);
+            close(stream.fd);
+        }
+        run->digest = stream.done ? stream.crc : BLANK_WORD;
+        free(stream.data);
+        free(stream.ends);
+    }
+    run->modem_writes = sim_modem_writes();
+    mailbox = mailbox_ptr();
+    if (mailbox)
+    {
+        memcpy(&run->mailbox, (const void *)mailbox, sizeof(run->mailbox));
+    }
+    if (dump_path)
+    {
+        dump_flash(dump_path);
+    }
+}
+
+static int run_forked(const char *hex_path, const char *modem_hex_path, const char *dump_path,
+                      u32_t timeout_ms, struct sim_run *run)
+{
+    int fds[2];
+    pid_t pid;
+    ssize_t len;
+
+    if (pipe(fds))
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (0 == pid)
+    {
+        close(fds[0]);
+        run_once(hex_path, modem_hex_path, dump_path, timeout_ms, run);
+        len = write(fds[1], run, sizeof(*run));
+        _exit(len == sizeof(*run) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    len = read(fds[0], run, sizeof(*run));
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return (len == sizeof(*run)) ? 0 : -1;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-v] [-s | -u] [-r REPEAT] [-t TIMEOUT_MS] [-l WRITE_LATENCY_US]\n"
+            "       [-a AT_LATENCY_US] [-f INDEX[:CODE]] [-c CFUN_MODE] [-i IMEI]\n"
+            "       [-m MODEM_HEX_FILE] [-o DUMP_FILE] HEX_FILE\n"
+            "\n"
+            "Run the credential firmware on the host against the hex file produced by cred.py.\n"
+            "\n"
+            "  -v  print the firmware's printk output to stderr\n"
+            "  -s  stream the records through the firmware's ring buffer channel\n"
+            "  -u  send the records as frames over a pty standing in for UART_0\n"
+            "  -r  number of times to run the firmware (default 1)\n"
+            "  -t  time to wait for the firmware to finish (default %d ms)\n"
+            "  -l  simulated modem latency per credential write\n"
+            "  -a  simulated latency per AT command\n"
+            "  -f  fail the INDEXth credential write (from 0) with CODE (default 513)\n"
+            "  -c  modem functional mode at startup (default 0)\n"
+            "  -i  IMEI reported by the modem (default %s)\n"
+            "  -m  preload the modem with the credentials in another cred.py hex file\n"
+            "  -o  write the first %d bytes of the credential page to a file when finished\n",
+            name, DEFAULT_TIMEOUT_MS, DEFAULT_IMEI, DUMP_LEN);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *modem_hex_path = NULL;
+    const char *dump_path = NULL;
+    u32_t timeout_ms = DEFAULT_TIMEOUT_MS;
+    u64_t total_us = 0;
+    u64_t min_us = UINT64_MAX;
+    struct sim_run run;
+    int repeat = 1;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "vsur:t:l:a:f:c:i:m:o:h")))
+    {
+        switch (opt)
+        {
+        case 'v':
+            sim_config.verbose = true;
+            break;
+        case 's':
+            sim_config.stream = true;
+            break;
+        case 'u':
+            sim_config.uart = true;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            sim_config.write_latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            sim_config.at_latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            sim_config.fail_index = atoi(optarg);
+            sim_config.fail_code = strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 513;
+            break;
+        case 'c':
+            sim_config.cfun_mode = atoi(optarg);
+            break;
+        case 'i':
+            snprintf(sim_config.imei, sizeof(sim_config.imei), "%s", optarg);
+            break;
+        case 'm':
+            modem_hex_path = optarg;
+            break;
+        case 'o':
+            dump_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc || repeat < 1 || (sim_config.stream && sim_config.uart))
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    for (int i = 0; i < repeat; i++)
+    {
+        if (run_forked(argv[optind], modem_hex_path, dump_path, timeout_ms, &run) || run.status)
+        {
+            fprintf(stderr, "error: firmware did not finish (run %d)\n", i);
+            return 1;
+        }
+        total_us += run.elapsed_us;
+        if (run.elapsed_us < min_us)
+        {
+            min_us = run.elapsed_us;
+        }
+    }
+
+    printf("result: 0x%X\n", run.result);
+    printf("imei: %s\n", (MAILBOX_MAGIC == run.mailbox.magic) ? run.mailbox.imei : "");
+    printf("digest: 0x%08X\n", run.digest);
+    printf("cred_bytes: %u\n", run.cred_bytes);
+    printf("modem_writes: %u\n", run.modem_writes);
+    printf("boot_ms: %u\n", run.mailbox.boot_ms);
+    printf("cfun_mode: %u\n", run.mailbox.cfun_mode);
+    printf("cfun_changed: %u\n", run.mailbox.cfun_changed);
+    printf("cfun_ms: %u\n", run.mailbox.cfun_ms);
+    printf("cred_written: %u\n", run.mailbox.cred_written);
+    printf("cred_batched: %u\n", run.mailbox.cred_batched);
+    printf("cred_ms: %u\n", run.mailbox.cred_ms);
+    printf("runs: %d\n", repeat);
+    printf("elapsed_us_min: %llu\n", (unsigned long long)min_us);
+    printf("elapsed_us_avg: %llu\n", (unsigned long long)(total_us / repeat));
+    if (min_us)
+    {
+        printf("throughput_kbps: %.1f\n", (run.cred_bytes * 1000.0 * 1000.0) / (min_us * 1024.0));
+    }
+
+    return (run.result && BLANK_WORD != run.result) ? 1 : 0;
+}
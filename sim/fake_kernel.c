@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linker/linker-defs.h>
+#include <sys/crc.h>
+
+#include "sim.h"
+
+
+/* Only MODE_HASH uses it, and the simulator doesn't map the flash below the credential page. */
+char _image_rom_start[1];
+
+struct sim_core_debug sim_core_debug = { .DHCSR = CoreDebug_DHCSR_C_DEBUGEN_Msk };
+
+void sim_bkpt(void)
+{
+    sim_core_debug.DHCSR |= CoreDebug_DHCSR_S_HALT_Msk;
+    while (true)
+    {
+        pause();
+    }
+}
+
+static int (*printk_hook)(int);
+
+void __printk_hook_install(int (*fn)(int))
+{
+    printk_hook = fn;
+}
+
+void printk(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (printk_hook)
+    {
+        for (const char *c = buf; *c; c++)
+        {
+            printk_hook(*c);
+        }
+    }
+    if (sim_config.verbose)
+    {
+        fprintf(stderr, "fw: %s", buf);
+    }
+}
+
+s32_t k_sleep(s32_t ms)
+{
+    usleep(ms * 1000);
+    return 0;
+}
+
+static u64_t boot_ms;
+
+static u64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Start the uptime from zero, as a reset would. */
+void sim_kernel_boot(void)
+{
+    boot_ms = monotonic_ms();
+}
+
+u32_t k_uptime_get_32(void)
+{
+    return (u32_t)(monotonic_ms() - boot_ms);
+}
+
+void *k_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void k_free(void *ptr)
+{
+    free(ptr);
+}
+
+u32_t crc32_ieee(const u8_t *data, size_t len)
+{
+    return crc32_ieee_update(0, data, len);
+}
+
+u32_t crc32_ieee_update(u32_t crc, const u8_t *data, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
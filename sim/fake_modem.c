@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <modem/at_cmd.h>
+#include <modem/modem_key_mgmt.h>
+#include <net/socket.h>
+
+#include "sim.h"
+
+
+#define SIM_MAX_CREDS   1024
+#define SIM_AT_FD       3
+#define SHA256_LEN      32
+
+/* Credentials can only be written while the modem is powered off (0) or offline (4). */
+#define CFUN_MODE_IS_ONLINE(mode) (0 != (mode) && 4 != (mode))
+
+struct sim_cred {
+    u32_t sec_tag;
+    u8_t  cred_type;
+    u8_t  sha[SHA256_LEN];
+};
+
+static struct sim_cred store[SIM_MAX_CREDS];
+static u32_t store_count;
+static u32_t write_count;
+static int   cfun_mode;
+static char  at_response[64];
+
+static const u32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(u32_t state[8], const u8_t block[64])
+{
+    u32_t w[64];
+    u32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((u32_t)block[i * 4] << 24) | ((u32_t)block[i * 4 + 1] << 16) |
+               ((u32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        u32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        u32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                   sha256_k[i] + w[i];
+        u32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sim_sha256(const u8_t *data, size_t len, u8_t digest[32])
+{
+    u32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    u8_t block[64];
+    size_t i = 0;
+    u64_t bits = (u64_t)len * 8;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        sha256_block(state, &data[i]);
+    }
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, &data[i], len - i);
+    block[len - i] = 0x80;
+    if (len - i >= 56)
+    {
+        sha256_block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    for (int j = 0; j < 8; j++)
+    {
+        block[63 - j] = (u8_t)(bits >> (j * 8));
+    }
+    sha256_block(state, block);
+
+    for (int j = 0; j < 8; j++)
+    {
+        digest[j * 4] = state[j] >> 24;
+        digest[j * 4 + 1] = state[j] >> 16;
+        digest[j * 4 + 2] = state[j] >> 8;
+        digest[j * 4 + 3] = state[j];
+    }
+}
+
+void sim_modem_reset(void)
+{
+    store_count = 0;
+    write_count = 0;
+    cfun_mode = sim_config.cfun_mode;
+}
+
+u32_t sim_modem_writes(void)
+{
+    return write_count;
+}
+
+int sim_modem_store(u32_t sec_tag, u8_t cred_type, const u8_t *content, size_t len)
+{
+    struct sim_cred *cred = NULL;
+
+    for (u32_t i = 0; i < store_count; i++)
+    {
+        if (store[i].sec_tag == sec_tag && store[i].cred_type == cred_type)
+        {
+            cred = &store[i];
+        }
+    }
+    if (!cred)
+    {
+        if (SIM_MAX_CREDS == store_count)
+        {
+            return -ENOMEM;
+        }
+        cred = &store[store_count++];
+    }
+
+    cred->sec_tag = sec_tag;
+    cred->cred_type = cred_type;
+    sim_sha256(content, len, cred->sha);
+    return 0;
+}
+
+/* Applies the configured latency and failure injection to one credential write. */
+static int sim_modem_write(u32_t sec_tag, u8_t cred_type, const u8_t *content, size_t len)
+{
+    int index = write_count++;
+
+    usleep(sim_config.write_latency_us);
+    if (CFUN_MODE_IS_ONLINE(cfun_mode))
+    {
+        return -EPERM;
+    }
+    if (index == sim_config.fail_index)
+    {
+        return sim_config.fail_code;
+    }
+    return sim_modem_store(sec_tag, cred_type, content, len);
+}
+
+int sim_modem_preload(const char *hex_path)
+{
+    u32_t addr = FIRST_CRED_ADDR;
+    u32_t end;
+    int err;
+
+    err = sim_hex_load(hex_path);
+    if (err)
+    {
+        return err;
+    }
+
+    end = FIRST_CRED_ADDR + sim_flash_word(RECORDS_LEN_ADDR);
+    while (BLANK_WORD != sim_flash_word(RECORDS_LEN_ADDR) && addr + 7 <= end)
+    {
+        u32_t sec_tag;
+        u16_t len;
+        u8_t cred_type;
+
+        memcpy(&sec_tag, sim_flash_ptr(addr), sizeof(sec_tag));
+        cred_type = *sim_flash_ptr(addr + 4);
+        memcpy(&len, sim_flash_ptr(addr + 5), sizeof(len));
+        sim_modem_store(sec_tag, cred_type, sim_flash_ptr(addr + 7), len);
+        addr += 7 + len;
+    }
+
+    sim_flash_erase();
+    return 0;
+}
+
+static int list_creds(char *buf, size_t buf_len)
+{
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (u32_t i = 0; i < store_count; i++)
+    {
+        int len = snprintf(&buf[used], buf_len - used, "%%CMNG: %u,%u,\"",
+                           store[i].sec_tag, store[i].cred_type);
+        used += len;
+        for (int j = 0; j < SHA256_LEN && used < buf_len; j++)
+        {
+            used += snprintf(&buf[used], buf_len - used, "%02X", store[i].sha[j]);
+        }
+        if (used >= buf_len)
+        {
+            return -E2BIG;
+        }
+        used += snprintf(&buf[used], buf_len - used, "\"\r\n");
+    }
+    return (used < buf_len) ? 0 : -E2BIG;
+}
+
+int at_cmd_write(const char *const cmd, char *buf, size_t buf_len, enum at_cmd_state *state)
+{
+    u32_t sec_tag;
+    u32_t key_type;
+
+    usleep(sim_config.at_latency_us);
+    *state = AT_CMD_OK;
+
+    if (0 == strcmp(cmd, "AT+CFUN?"))
+    {
+        snprintf(buf, buf_len, "+CFUN: %d\r\n", cfun_mode);
+        return 0;
+    }
+    if (0 == strncmp(cmd, "AT+CFUN=", strlen("AT+CFUN=")))
+    {
+        cfun_mode = atoi(cmd + strlen("AT+CFUN="));
+        buf[0] = '\0';
+        return 0;
+    }
+    if (0 == strcmp(cmd, "AT+CGSN"))
+    {
+        snprintf(buf, buf_len, "%s\r\n", sim_config.imei);
+        return 0;
+    }
+    if (0 == strcmp(cmd, "AT%CMNG=1"))
+    {
+        return list_creds(buf, buf_len);
+    }
+    if (2 == sscanf(cmd, "AT%%KEYGEN=%u,%u,", &sec_tag, &key_type) &&
+        !CFUN_MODE_IS_ONLINE(cfun_mode))
+    {
+        /* Not a real CSR, only the same shape: base64url, a dot, and the COSE object. */
+        snprintf(buf, buf_len, "%%KEYGEN: \"U0lNIENTUiA%08X.0oRDoQEmoQRBIVhL\"\r\n",
+                 sec_tag);
+        return sim_modem_store(sec_tag, key_type, (const u8_t *)sim_config.imei,
+                               strlen(sim_config.imei));
+    }
+
+    *state = AT_CMD_ERROR;
+    return -ENOEXEC;
+}
+
+int modem_key_mgmt_write(nrf_sec_tag_t sec_tag,
+                         enum modem_key_mgnt_cred_type cred_type,
+                         const void *buf, u16_t len)
+{
+    usleep(sim_config.at_latency_us);
+    return sim_modem_write(sec_tag, cred_type, buf, len);
+}
+
+int sim_at_socket(int family, int type, int proto)
+{
+    if (AF_LTE != family || NPROTO_AT != proto)
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    at_response[0] = '\0';
+    return SIM_AT_FD;
+}
+
+ssize_t sim_at_send(int fd, const void *buf, size_t len, int flags)
+{
+    const char *cmd = buf;
+    const char *content;
+    const char *end;
+    u32_t sec_tag;
+    u32_t cred_type;
+    int err = -ENOEXEC;
+
+    usleep(sim_config.at_latency_us);
+
+    if (len == strlen("AT+CMEE=1") && 0 == strncmp(cmd, "AT+CMEE=1", len))
+    {
+        err = 0;
+    }
+    else if (2 == sscanf(cmd, "AT%%CMNG=0,%u,%u,", &sec_tag, &cred_type))
+    {
+        content = memchr(cmd, '"', len);
+        end = &cmd[len - 1];
+        if (content && content < end && '"' == *end)
+        {
+            content++;
+            err = sim_modem_write(sec_tag, cred_type, (const u8_t *)content, end - content);
+        }
+    }
+
+    if (!err)
+    {
+        snprintf(at_response, sizeof(at_response), "OK\r\n");
+    }
+    else if (err > 0)
+    {
+        snprintf(at_response, sizeof(at_response), "+CME ERROR: %d\r\n", err);
+    }
+    else
+    {
+        snprintf(at_response, sizeof(at_response), "ERROR\r\n");
+    }
+    return len;
+}
+
+ssize_t sim_at_recv(int fd, void *buf, size_t len, int flags)
+{
+    size_t response_len = strlen(at_response);
+
+    if (response_len > len)
+    {
+        response_len = len;
+    }
+    memcpy(buf, at_response, response_len);
+    at_response[0] = '\0';
+    return response_len;
+}
+
+int sim_at_close(int fd)
+{
+    return 0;
+}
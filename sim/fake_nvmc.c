@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <nrfx_nvmc.h>
+
+#include "sim.h"
+
+
+static u8_t *flash;
+
+int sim_flash_init(void)
+{
+    flash = mmap((void *)SIM_FLASH_ADDR, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (MAP_FAILED == flash || (void *)SIM_FLASH_ADDR != flash)
+    {
+        perror("mmap");
+        return -1;
+    }
+    sim_flash_erase();
+    return 0;
+}
+
+void sim_flash_erase(void)
+{
+    memset(flash, 0xFF, SIM_FLASH_SIZE);
+}
+
+u8_t *sim_flash_ptr(u32_t addr)
+{
+    if (addr < SIM_FLASH_ADDR || addr >= SIM_FLASH_ADDR + SIM_FLASH_SIZE)
+    {
+        return NULL;
+    }
+    return &flash[addr - SIM_FLASH_ADDR];
+}
+
+u32_t sim_flash_word(u32_t addr)
+{
+    u32_t value;
+
+    memcpy(&value, sim_flash_ptr(addr), sizeof(value));
+    return value;
+}
+
+void nrfx_nvmc_word_write(u32_t address, u32_t value)
+{
+    u8_t *dst = sim_flash_ptr(address);
+    u32_t current;
+
+    memcpy(&current, dst, sizeof(current));
+    current &= value;
+    memcpy(dst, &current, sizeof(current));
+}
+
+void nrfx_nvmc_bytes_write(u32_t address, void const *src, u32_t num_bytes)
+{
+    const u8_t *bytes = src;
+    u8_t *dst = sim_flash_ptr(address);
+
+    for (u32_t i = 0; i < num_bytes; i++)
+    {
+        dst[i] &= bytes[i];
+    }
+}
+
+bool nrfx_nvmc_byte_writable_check(u32_t address, u8_t value)
+{
+    u8_t current = *sim_flash_ptr(address);
+
+    return (current & value) == value;
+}
+
+bool nrfx_nvmc_write_done_check(void)
+{
+    return true;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/*
+ * UART_0 is the master side of a pty. A thread stands in for the RX interrupt by reading one
+ * byte at a time and calling the installed callback, which picks it up with uart_fifo_read().
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <drivers/uart.h>
+
+#include "sim.h"
+
+
+static struct device uart0 = { .name = "UART_0" };
+static struct uart_config uart_config = { .baudrate = 115200, .data_bits = 3, .stop_bits = 1 };
+static uart_irq_callback_t uart_callback;
+static volatile bool rx_enabled;
+static volatile bool rx_ready;
+static u8_t rx_byte;
+static pthread_t rx_thread;
+static bool rx_thread_started;
+static int uart_fd = -1;
+
+/* Opens the pty and returns the path of the side that the host should use. */
+const char *sim_uart_open(void)
+{
+    struct termios tio;
+    int slave_fd;
+
+    uart_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (uart_fd < 0 || grantpt(uart_fd) || unlockpt(uart_fd))
+    {
+        return NULL;
+    }
+
+    /* Raw mode so that nothing is echoed or translated. The master is held open so the slave
+     * keeps its settings when the host opens it.
+     */
+    slave_fd = open(ptsname(uart_fd), O_RDWR | O_NOCTTY);
+    if (slave_fd < 0 || tcgetattr(slave_fd, &tio))
+    {
+        return NULL;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+    close(slave_fd);
+    return ptsname(uart_fd);
+}
+
+struct device *device_get_binding(const char *name)
+{
+    if (uart_fd < 0 || strcmp(name, uart0.name))
+    {
+        return NULL;
+    }
+    return &uart0;
+}
+
+int uart_config_get(struct device *dev, struct uart_config *cfg)
+{
+    *cfg = uart_config;
+    return 0;
+}
+
+int uart_configure(struct device *dev, const struct uart_config *cfg)
+{
+    /* A pty has no baud rate so the setting is only remembered. */
+    uart_config = *cfg;
+    return 0;
+}
+
+static void *rx_thread_fn(void *arg)
+{
+    u8_t byte;
+
+    while (1 == read(uart_fd, &byte, 1))
+    {
+        while (!rx_enabled || rx_ready)
+        {
+            usleep(10);
+        }
+        rx_byte = byte;
+        rx_ready = true;
+        uart_callback(&uart0);
+    }
+    return NULL;
+}
+
+void uart_irq_callback_set(struct device *dev, uart_irq_callback_t cb)
+{
+    uart_callback = cb;
+}
+
+void uart_irq_rx_enable(struct device *dev)
+{
+    rx_enabled = true;
+    if (!rx_thread_started)
+    {
+        rx_thread_started = true;
+        pthread_create(&rx_thread, NULL, rx_thread_fn, NULL);
+    }
+}
+
+void uart_irq_rx_disable(struct device *dev)
+{
+    rx_enabled = false;
+}
+
+int uart_irq_update(struct device *dev)
+{
+    return 1;
+}
+
+int uart_irq_rx_ready(struct device *dev)
+{
+    return rx_ready;
+}
+
+int uart_fifo_read(struct device *dev, u8_t *rx_data, const int size)
+{
+    if (!rx_ready || size < 1)
+    {
+        return 0;
+    }
+    *rx_data = rx_byte;
+    rx_ready = false;
+    return 1;
+}
+
+void uart_poll_out(struct device *dev, unsigned char out_char)
+{
+    while (-1 == write(uart_fd, &out_char, 1) && EINTR == errno)
+    {
+    }
+}
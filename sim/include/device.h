@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#ifndef SIM_DEVICE_H__
+#define SIM_DEVICE_H__
+
+#include <zephyr.h>
+
+struct device {
+    const char *name;
+};
+
+struct device *device_get_binding(const char *name);
+
+#endif /* SIM_DEVICE_H__ */
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the interrupt-driven UART API, backed by a pty (see fake_uart.c). */
+
+#ifndef SIM_DRIVERS_UART_H__
+#define SIM_DRIVERS_UART_H__
+
+#include <device.h>
+
+struct uart_config {
+    u32_t baudrate;
+    u8_t  parity;
+    u8_t  stop_bits;
+    u8_t  data_bits;
+    u8_t  flow_ctrl;
+};
+
+typedef void (*uart_irq_callback_t)(struct device *dev);
+
+int uart_config_get(struct device *dev, struct uart_config *cfg);
+int uart_configure(struct device *dev, const struct uart_config *cfg);
+void uart_irq_callback_set(struct device *dev, uart_irq_callback_t cb);
+void uart_irq_rx_enable(struct device *dev);
+void uart_irq_rx_disable(struct device *dev);
+int uart_irq_update(struct device *dev);
+int uart_irq_rx_ready(struct device *dev);
+int uart_fifo_read(struct device *dev, u8_t *rx_data, const int size);
+void uart_poll_out(struct device *dev, unsigned char out_char);
+
+#endif /* SIM_DRIVERS_UART_H__ */
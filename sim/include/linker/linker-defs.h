@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the linker script symbols (see fake_kernel.c). */
+
+#ifndef SIM_LINKER_LINKER_DEFS_H__
+#define SIM_LINKER_LINKER_DEFS_H__
+
+extern char _image_rom_start[];
+
+#endif /* SIM_LINKER_LINKER_DEFS_H__ */
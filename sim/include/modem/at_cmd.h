@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the AT command library, backed by the simulated modem. */
+
+#ifndef SIM_AT_CMD_H__
+#define SIM_AT_CMD_H__
+
+#include <zephyr.h>
+
+enum at_cmd_state {
+    AT_CMD_OK,
+    AT_CMD_ERROR,
+    AT_CMD_ERROR_CMS,
+    AT_CMD_ERROR_CME,
+    AT_CMD_ERROR_QUEUE,
+    AT_CMD_ERROR_WAIT_TIMEOUT,
+    AT_CMD_NOTIFICATION,
+};
+
+int at_cmd_write(const char *const cmd, char *buf, size_t buf_len, enum at_cmd_state *state);
+
+#endif /* SIM_AT_CMD_H__ */
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the modem key management library, backed by the simulated modem. */
+
+#ifndef SIM_MODEM_KEY_MGMT_H__
+#define SIM_MODEM_KEY_MGMT_H__
+
+#include <zephyr.h>
+
+typedef u32_t nrf_sec_tag_t;
+
+enum modem_key_mgnt_cred_type {
+    MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN,
+    MODEM_KEY_MGMT_CRED_TYPE_PUBLIC_CERT,
+    MODEM_KEY_MGMT_CRED_TYPE_PRIVATE_CERT,
+    MODEM_KEY_MGMT_CRED_TYPE_PSK,
+    MODEM_KEY_MGMT_CRED_TYPE_IDENTITY,
+};
+
+int modem_key_mgmt_write(nrf_sec_tag_t sec_tag,
+                         enum modem_key_mgnt_cred_type cred_type,
+                         const void *buf, u16_t len);
+
+#endif /* SIM_MODEM_KEY_MGMT_H__ */
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the offloaded AT socket. The calls are renamed so they don't collide
+ * with the host's own socket API.
+ */
+
+#ifndef SIM_NET_SOCKET_H__
+#define SIM_NET_SOCKET_H__
+
+#include <zephyr.h>
+
+#define AF_LTE    102
+#define NPROTO_AT 513
+
+#define socket(family, type, proto) sim_at_socket(family, type, proto)
+#define send(fd, buf, len, flags)   sim_at_send(fd, buf, len, flags)
+#define recv(fd, buf, len, flags)   sim_at_recv(fd, buf, len, flags)
+#define close(fd)                   sim_at_close(fd)
+
+int sim_at_socket(int family, int type, int proto);
+ssize_t sim_at_send(int fd, const void *buf, size_t len, int flags);
+ssize_t sim_at_recv(int fd, void *buf, size_t len, int flags);
+int sim_at_close(int fd);
+
+#endif /* SIM_NET_SOCKET_H__ */
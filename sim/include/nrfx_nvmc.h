@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the NVMC driver. Writes can only clear bits, like real flash. */
+
+#ifndef SIM_NRFX_NVMC_H__
+#define SIM_NRFX_NVMC_H__
+
+#include <zephyr.h>
+
+void nrfx_nvmc_word_write(u32_t address, u32_t value);
+void nrfx_nvmc_bytes_write(u32_t address, void const *src, u32_t num_bytes);
+bool nrfx_nvmc_byte_writable_check(u32_t address, u8_t value);
+bool nrfx_nvmc_write_done_check(void);
+
+#endif /* SIM_NRFX_NVMC_H__ */
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#ifndef SIM_SYS_CRC_H__
+#define SIM_SYS_CRC_H__
+
+#include <zephyr.h>
+
+u32_t crc32_ieee(const u8_t *data, size_t len);
+u32_t crc32_ieee_update(u32_t crc, const u8_t *data, size_t len);
+
+#endif /* SIM_SYS_CRC_H__ */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host stand-in for the parts of the Zephyr kernel API that src/main.c uses. */
+
+#ifndef SIM_ZEPHYR_H__
+#define SIM_ZEPHYR_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint8_t  u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int32_t  s32_t;
+typedef uint64_t u64_t;
+
+#define CONFIG_AT_CMD_RESPONSE_MAX_LEN 4096
+
+#define __DMB() __sync_synchronize()
+#define __used  __attribute__((__used__))
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/* The simulator acts as an attached debugger: __BKPT() sets S_HALT and stops the firmware. */
+struct sim_core_debug {
+    volatile u32_t DHCSR;
+};
+
+extern struct sim_core_debug sim_core_debug;
+
+#define CoreDebug                       (&sim_core_debug)
+#define CoreDebug_DHCSR_C_DEBUGEN_Msk   (1UL << 0)
+#define CoreDebug_DHCSR_S_HALT_Msk      (1UL << 17)
+#define __BKPT(value)                   sim_bkpt()
+
+void sim_bkpt(void);
+
+void printk(const char *fmt, ...);
+void __printk_hook_install(int (*fn)(int));
+u32_t k_uptime_get_32(void);
+s32_t k_sleep(s32_t ms);
+void *k_malloc(size_t size);
+void k_free(void *ptr);
+
+#endif /* SIM_ZEPHYR_H__ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Shared state for the host build of the credential firmware. */
+
+#ifndef SIM_H__
+#define SIM_H__
+
+#include <zephyr.h>
+
+/* These must match src/main.c. */
+#define CRED_PAGE_ADDR      0x2B000
+#define FW_RESULT_CODE_ADDR (CRED_PAGE_ADDR + 4)
+#define IMEI_ADDR           (FW_RESULT_CODE_ADDR + 4)
+#define CRED_DIGEST_ADDR    (IMEI_ADDR + 16)
+#define MAILBOX_ADDR_ADDR   (CRED_DIGEST_ADDR + 4)
+#define RECORDS_LEN_ADDR    (MAILBOX_ADDR_ADDR + 4)
+#define MODE_ADDR           (RECORDS_LEN_ADDR + 4)
+#define FIRST_CRED_ADDR     (MODE_ADDR + 1)
+
+#define FLASH_END_ADDR      0x100000
+#define FLASH_PAGE_SIZE     0x1000
+
+#define MAGIC_NUMBER        0xCA5CAD1A
+#define LOCATOR_MAGIC       0x45474150
+#define MODE_IMEI           0x02
+#define MODE_STREAM         0x04
+#define MODE_UART           0x05
+#define MODE_KEYGEN         0x07
+#define STREAM_END_SEC_TAG  0xFFFFFFFF
+#define MAILBOX_MAGIC       0x4D41494C
+#define BLANK_WORD          0xFFFFFFFF
+
+/* The simulated flash is mapped at its real address so main.c can dereference it. */
+#define SIM_FLASH_ADDR      CRED_PAGE_ADDR
+#define SIM_FLASH_SIZE      0x100000
+
+#define SIM_IMEI_LEN        15
+
+/* Mirror of struct mailbox in src/main.c. */
+struct sim_mailbox {
+    u32_t magic;
+    char  imei[SIM_IMEI_LEN + 1];
+    u32_t cfun_ms;
+    u8_t  cfun_mode;
+    u8_t  cfun_changed;
+    u16_t cred_written;
+    u32_t cred_ms;
+    u8_t  cred_batched;
+    u32_t channel_addr;
+    u32_t boot_ms;
+};
+
+/* Mirror of struct ring and struct channel in src/main.c. */
+struct sim_ring {
+    u32_t name;
+    u32_t buf;
+    u32_t size;
+    volatile u32_t wr_off;
+    volatile u32_t rd_off;
+    u32_t flags;
+};
+
+struct sim_channel {
+    char  id[16];
+    s32_t max_up;
+    s32_t max_down;
+    struct sim_ring up;
+    struct sim_ring down;
+};
+
+struct sim_config {
+    bool  verbose;
+    u32_t write_latency_us;
+    u32_t at_latency_us;
+    int   fail_index;
+    int   fail_code;
+    int   cfun_mode;
+    bool  stream;
+    bool  uart;
+    char  imei[SIM_IMEI_LEN + 1];
+};
+
+extern struct sim_config sim_config;
+
+int sim_flash_init(void);
+void sim_flash_erase(void);
+u8_t *sim_flash_ptr(u32_t addr);
+u32_t sim_flash_word(u32_t addr);
+int sim_hex_load(const char *path);
+
+void sim_modem_reset(void);
+int sim_modem_store(u32_t sec_tag, u8_t cred_type, const u8_t *content, size_t len);
+int sim_modem_preload(const char *hex_path);
+u32_t sim_modem_writes(void);
+
+const char *sim_uart_open(void);
+
+void sim_kernel_boot(void);
+
+void sim_sha256(const u8_t *data, size_t len, u8_t digest[32]);
+
+#endif /* SIM_H__ */
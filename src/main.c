@@ -14,36 +14,249 @@
  *  result code once credentials are written. This prevents the credentials from being
  *  written multiple times and allows the result code to be read over SWD if necessary.
  *
+ *  The cred_digest is a CRC32 (IEEE) of the credential records that were written. It is
+ *  written just before a successful fw_result_code so the host can confirm that the modem
+ *  received exactly the records it built.
+ *
+ *  In MODE_CHECK nothing is written to the modem. Instead the raw AT%CMNG=1 listing (one
+ *  "%CMNG: <sec_tag>,<type>[,<sha256>]" line per stored credential) is written as a
+ *  NUL-terminated string where the first credential would otherwise be.
+ *
+ *  The mailbox_addr is written as soon as the firmware starts and points to a small struct
+ *  in RAM that the host can poll over SWD. The IMEI is published there as soon as AT+CGSN
+ *  returns. In MODE_IMEI that is all the firmware does: the modem is left in its current
+ *  functional mode and nothing else is written to flash.
+ *
+ *  The mailbox also records how the modem was taken offline: the mode reported by AT+CFUN?,
+ *  whether AT+CFUN=0 was actually needed, and the time spent doing so. boot_ms is the uptime
+ *  when the first AT command is sent, which covers kernel and bsdlib initialization but not
+ *  the bootloader or SPM that run before the kernel starts.
+ *
+ *  MODE_WRITE_BATCHED writes the same credentials as MODE_WRITE but streams the AT%CMNG=0
+ *  commands back-to-back through a single AT socket
+ *  instead of going through modem_key_mgmt_write() (and its AT+CMEE round trips) per record.
+ *  Both paths record the number of credentials written and the time spent in the mailbox.
+ *  The batched commands are assembled in a single static buffer straight from flash so no
+ *  heap is used regardless of the size of the credential.
+ *
+ *  MODE_WRITE_FRAGMENTED is MODE_WRITE_BATCHED without the static buffer: each command is sent
+ *  as its prefix, the content in runs from where it is (with the IMEI sent in place of each
+ *  placeholder), and the closing quote, and only then is the response read. The AT socket has
+ *  so far treated every send() as a complete command, so this mode is experimental until it is
+ *  verified on hardware and nothing else uses it.
+ *
+ *  The records are a stream terminated by records_len (the number of bytes that follow the
+ *  mode) rather than a count, so there is no limit on the number of credentials other than
+ *  the size of flash. The stream is walked once before anything is written so a truncated
+ *  record is rejected up front, and then once more while writing.
+ *
+ *  MODE_STREAM doesn't read any records from flash. Instead a ring buffer channel with the
+ *  same layout as a SEGGER RTT control block (one up and one down buffer) is set up in RAM and
+ *  its address is published in the mailbox. The host writes records, in the same format as
+ *  in flash, into the down buffer over SWD and ends them with a record whose sec_tag is
+ *  0xFFFFFFFF. Each record is written to the modem as soon as it has arrived and its result
+ *  is sent back on the up buffer as "%CRED: <index>,<result>", followed at the end by
+ *  "%DONE: <result>,<count>,<crc32 of the records>". printk output is also redirected to the
+ *  up buffer. Failed records don't stop the stream so the host learns the result of each one.
+ *
+ *  MODE_UART receives the same records over UART_0 instead, for fixtures where SWD is shared
+ *  or slow. The UART is taken over from the AT host library and switched to UART_BAUDRATE, and
+ *  "%READY: <bytes>" announces how much the receive buffer holds. Each record is framed as
+ *  [u16_t len][record][u32_t crc32 of the record] so a corrupted record is reported as -EBADMSG
+ *  instead of being written. The host keeps no more than the announced number of bytes in
+ *  flight beyond the first record that hasn't been answered. The result lines are the same as
+ *  in MODE_STREAM and printk output stays on the same UART.
+ *
+ *  The credential page isn't at a fixed address. The host places it at the first flash page
+ *  boundary after the firmware, so no more flash than necessary is erased and programmed, and
+ *  patches its address into the locator (found by LOCATOR_MAGIC) before programming. An
+ *  unpatched locator points at CRED_PAGE_DEFAULT_ADDR, where older hosts put the page.
+ *
+ *  Every occurrence of IMEI_PLACEHOLDER in a credential's content is replaced with the IMEI
+ *  read by AT+CGSN before it is written to the modem, whichever mode writes it, so credentials
+ *  derived from the IMEI (e.g. a PSK identity of "nrf-{IMEI}") are written in the same boot
+ *  that reads it. The records themselves, and so cred_digest and the stream's CRC, are left as
+ *  the host built them.
+ *
+ *  MODE_KEYGEN has the modem generate a private key so that it never leaves the device. The
+ *  only record names the sec_tag and type (client private key) of the key and has no content.
+ *  AT%KEYGEN returns a PKCS#10 CSR for it, which is written as a NUL-terminated base64url string
+ *  right after that record. The firmware then carries on as in MODE_STREAM, so the host can
+ *  sign the CSR and stream the client certificate (and any other credentials) in the same boot.
+ *
+ *  MODE_HASH doesn't touch the modem. Where the first credential would otherwise be, it writes
+ *  the address of the first non-secure flash page followed by a CRC32 of every page from there
+ *  to FLASH_END_ADDR, so the host can tell which pages of an application differ from what is
+ *  already in flash. The pages below the firmware belong to the secure partition manager and a
+ *  non-secure read of them faults, so they aren't hashed and the host always reprograms them.
+ *  The firmware's own pages and the credential page are hashed as well, and the host always
+ *  reprograms those too.
+ *
+ *  Once finished, whether successfully or not, the firmware executes a breakpoint if a debugger
+ *  is attached so the host can detect completion from the core's halted state (DHCSR) instead
+ *  of polling flash. Without a debugger the breakpoint would escalate to a HardFault so the
+ *  firmware just loops.
+ *
  *  [MAGIC_NUMBER (0xCA5CAD1A)]
  *  [int32_t fw_result_code]
  *  [char[] IMEI]
- *  [u8_t num_credentials]
+ *  [u32_t cred_digest]
+ *  [u32_t mailbox_addr]
+ *  [u32_t records_len]
+ *  [u8_t mode]
  *  [u32_t nrf_sec_tag_t][u8_t nrf_key_mgnt_cred_type_t][u16_t len][char[] credential]
  *  ...
  *  [u32_t nrf_sec_tag_t][u8_t nrf_key_mgnt_cred_type_t][u16_t len][char[] credential]
  */
 
 #include <zephyr.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <device.h>
+#include <drivers/uart.h>
+#include <linker/linker-defs.h>
+#include <sys/crc.h>
 #include <nrfx_nvmc.h>
+#include <net/socket.h>
 #include <modem/at_cmd.h>
 #include <modem/modem_key_mgmt.h>
 
 
-#define CRED_PAGE_ADDR      0x2B000
+#define CRED_PAGE_ADDR      (locator.page_addr)
+#define CRED_PAGE_DEFAULT_ADDR 0x2B000
 #define FW_RESULT_CODE_ADDR (CRED_PAGE_ADDR + 4)
 #define IMEI_ADDR           (FW_RESULT_CODE_ADDR + 4)
-#define CRED_COUNT_ADDR     (IMEI_ADDR + 16)
-#define FIRST_CRED_ADDR     (CRED_COUNT_ADDR + 1)
+#define CRED_DIGEST_ADDR    (IMEI_ADDR + 16)
+#define MAILBOX_ADDR_ADDR   (CRED_DIGEST_ADDR + 4)
+#define RECORDS_LEN_ADDR    (MAILBOX_ADDR_ADDR + 4)
+#define MODE_ADDR           (RECORDS_LEN_ADDR + 4)
+#define FIRST_CRED_ADDR     (MODE_ADDR + 1)
+#define CHECK_LIST_ADDR     FIRST_CRED_ADDR
+#define PAGE_HASHES_ADDR    FIRST_CRED_ADDR
+#define CSR_ADDR            (FIRST_CRED_ADDR + RECORD_HEADER_LEN)
+#define FLASH_END_ADDR      0x100000
+#define FLASH_PAGE_SIZE     0x1000
 
 #define MAGIC_NUMBER        0xCA5CAD1A
-#define ERROR_CRED_COUNT    0xFF
+#define LOCATOR_MAGIC       0x45474150
+#define BLANK_RECORDS_LEN   0xFFFFFFFF
 #define BLANK_FW_RESULT     0xFFFFFFFF
+#define RECORD_HEADER_LEN   (sizeof(nrf_sec_tag_t) + sizeof(u8_t) + sizeof(u16_t))
+
+#define MODE_WRITE          0x00
+#define MODE_CHECK          0x01
+#define MODE_IMEI           0x02
+#define MODE_WRITE_BATCHED  0x03
+#define MODE_STREAM         0x04
+#define MODE_UART           0x05
+#define MODE_HASH           0x06
+#define MODE_KEYGEN         0x07
+#define MODE_WRITE_FRAGMENTED 0x08
+
+#define MAILBOX_MAGIC       0x4D41494C
 
 #define IMEI_LEN            15
+#define IMEI_PLACEHOLDER    "{IMEI}"
+
+#define CFUN_RESPONSE       "+CFUN:"
+#define CFUN_MODE_POWER_OFF 0
+#define CFUN_MODE_OFFLINE   4
+#define CFUN_MODE_UNKNOWN   0xFF
+
+#define CMNG_WRITE_PREFIX   "AT%%CMNG=0,%u,%d,\""
+#define CMNG_WRITE_SUFFIX   "\""
+#define CMNG_PREFIX_MAX_LEN 32
+#define MAX_CRED_LEN        4096
+#define KEYGEN_CMD          "AT%%KEYGEN=%u,%d,0"
+#define KEYGEN_RESPONSE     "%KEYGEN: \""
+#define AT_RESPONSE_OK      "OK"
+#define AT_RESPONSE_CME     "+CME ERROR:"
+
+#define CHANNEL_ID          "SEGGER RTT"
+#define CHANNEL_UP_SIZE     1024
+#define CHANNEL_DOWN_SIZE   2048
+#define CHANNEL_LINE_LEN    64
+#define CHANNEL_POLL_MS     1
+#define STREAM_END_SEC_TAG  0xFFFFFFFF
+
+#define UART_DEV_NAME       "UART_0"
+#define UART_BAUDRATE       1000000
+#define UART_RX_SIZE        4096
+
+
+/* The magic value is written last so the host never sees a partially published IMEI. */
+struct mailbox {
+    u32_t magic;
+    char  imei[IMEI_LEN + 1];
+    u32_t cfun_ms;
+    u8_t  cfun_mode;
+    u8_t  cfun_changed;
+    u16_t cred_written;
+    u32_t cred_ms;
+    u8_t  cred_batched;
+    u32_t channel_addr;
+    u32_t boot_ms;
+};
+
+/* Same layout as a SEGGER RTT buffer descriptor. Addresses are stored as u32_t so the layout
+ * is the same wherever the firmware is built.
+ */
+struct ring {
+    u32_t name;
+    u32_t buf;
+    u32_t size;
+    volatile u32_t wr_off;
+    volatile u32_t rd_off;
+    u32_t flags;
+};
+
+/* Same layout as a SEGGER RTT control block. The id is written last so a host that searches
+ * for it never finds a partially initialized block.
+ */
+struct channel {
+    char  id[16];
+    s32_t max_up;
+    s32_t max_down;
+    struct ring up;
+    struct ring down;
+};
 
+/* Where stream_credentials() reads records from and sends its result lines to. */
+struct transport {
+    struct ring *rx;
+    void (*tx)(const u8_t *data, u32_t len);
+    bool framed;
+};
+
+/* Patched by the host with the address of the credential page. Volatile so the address is
+ * read from flash instead of being folded into the code as the unpatched default.
+ */
+struct locator {
+    u32_t magic;
+    u32_t page_addr;
+};
+
+struct cred_record {
+    nrf_sec_tag_t sec_tag;
+    enum modem_key_mgnt_cred_type cred_type;
+    const u8_t *content;
+    u16_t len;
+};
+
+static const volatile struct locator locator __used = {
+    .magic = LOCATOR_MAGIC,
+    .page_addr = CRED_PAGE_DEFAULT_ADDR,
+};
+static volatile struct mailbox mailbox;
+static struct channel channel;
+static struct ring uart_rx;
+static struct device *uart_dev;
+
+extern void __printk_hook_install(int (*fn)(int));
 
 /**@brief Recoverable BSD library error. */
 void bsd_recoverable_error_handler(u32_t err)
@@ -88,14 +301,78 @@ static int query_modem(const char *cmd, char *buf, size_t buf_len)
     return 0;
 }
 
-static void write_fw_result(int result)
+static int power_off_modem(char *buf, size_t buf_len)
+{
+    u32_t start = k_uptime_get_32();
+    int ret;
+
+    /* Writing credentials only requires the modem to be offline, which is also the state it
+     * boots in, so only change the functional mode if necessary.
+     */
+    ret = query_modem("AT+CFUN?", buf, buf_len);
+    if (!ret && (0 == strncmp(buf, CFUN_RESPONSE, strlen(CFUN_RESPONSE))))
+    {
+        mailbox.cfun_mode = atoi(buf + strlen(CFUN_RESPONSE));
+    }
+
+    if (CFUN_MODE_POWER_OFF == mailbox.cfun_mode || CFUN_MODE_OFFLINE == mailbox.cfun_mode)
+    {
+        ret = 0;
+    }
+    else
+    {
+        ret = query_modem("AT+CFUN=0", buf, buf_len);
+        mailbox.cfun_changed = (0 == ret);
+    }
+
+    mailbox.cfun_ms = k_uptime_get_32() - start;
+    return ret;
+}
+
+static void write_word(u32_t addr, u32_t value)
+{
+    nrfx_nvmc_word_write(addr, value);
+    while (!nrfx_nvmc_write_done_check())
+    {
+    }
+}
+
+static void write_bytes(u32_t addr, const void *data, u32_t len)
 {
-    nrfx_nvmc_word_write(FW_RESULT_CODE_ADDR, result);
+    nrfx_nvmc_bytes_write(addr, data, len);
     while (!nrfx_nvmc_write_done_check())
     {
     }
 }
 
+static void write_fw_result(int result)
+{
+    write_word(FW_RESULT_CODE_ADDR, result);
+}
+
+static bool fw_result_blank(void)
+{
+    /* Ensure that the credentials haven't already been written. */
+    int fw_result_code = *(int*)FW_RESULT_CODE_ADDR;
+    if (BLANK_FW_RESULT != fw_result_code)
+    {
+        printk("Exiting because fw_result_code has already been written: %d.\n", fw_result_code);
+        return false;
+    }
+    return true;
+}
+
+static void publish_imei(const char *buf)
+{
+    for (int i=0; i < IMEI_LEN; i++)
+    {
+        mailbox.imei[i] = buf[i];
+    }
+    mailbox.imei[IMEI_LEN] = '\0';
+    __DMB();
+    mailbox.magic = MAILBOX_MAGIC;
+}
+
 static bool write_imei(char *buf)
 {
     for (int i=0; i < IMEI_LEN; i++)
@@ -106,68 +383,707 @@ static bool write_imei(char *buf)
         }
     }
 
-    nrfx_nvmc_bytes_write(IMEI_ADDR, buf, IMEI_LEN);
-    while (!nrfx_nvmc_write_done_check())
+    write_bytes(IMEI_ADDR, buf, IMEI_LEN);
+    return true;
+}
+
+static void parse_credential(u32_t * addr, struct cred_record *rec)
+{
+    rec->sec_tag = *(u32_t*)*addr;
+    *addr += sizeof(nrf_sec_tag_t);
+
+    rec->cred_type = *(u8_t*)*addr;
+    *addr += sizeof(u8_t);
+
+    rec->len = *(u16_t*)*addr;
+    *addr += sizeof(u16_t);
+
+    rec->content = (const u8_t*)*addr;
+    *addr += rec->len;
+}
+
+static int expand_imei(struct cred_record *rec)
+{
+    /* Only used when there is a placeholder, otherwise the content is written from where it
+     * is.
+     */
+    static u8_t expanded[MAX_CRED_LEN];
+    const u16_t placeholder_len = strlen(IMEI_PLACEHOLDER);
+    u32_t len = 0;
+    u16_t i = 0;
+
+    while (i + placeholder_len <= rec->len &&
+           0 != memcmp(&rec->content[i], IMEI_PLACEHOLDER, placeholder_len))
     {
+        i++;
+    }
+    if (i + placeholder_len > rec->len)
+    {
+        return 0;
     }
 
-    return true;
+    i = 0;
+    while (i < rec->len)
+    {
+        bool placeholder = (i + placeholder_len <= rec->len &&
+                            0 == memcmp(&rec->content[i], IMEI_PLACEHOLDER, placeholder_len));
+        u32_t count = placeholder ? IMEI_LEN : 1;
+
+        if (len + count > sizeof(expanded))
+        {
+            return -EMSGSIZE;
+        }
+        if (placeholder)
+        {
+            memcpy(&expanded[len], (const u8_t *)IMEI_ADDR, IMEI_LEN);
+            i += placeholder_len;
+        }
+        else
+        {
+            expanded[len] = rec->content[i++];
+        }
+        len += count;
+    }
+
+    rec->content = expanded;
+    rec->len = len;
+    return 0;
 }
 
 static int parse_and_write_credential(u32_t * addr)
 {
+    struct cred_record rec;
     int ret;
 
-    nrf_sec_tag_t sec_tag = *(u32_t*)*addr;
-    *addr += sizeof(nrf_sec_tag_t);
+    parse_credential(addr, &rec);
+    ret = expand_imei(&rec);
+    if (ret)
+    {
+        return ret;
+    }
+    return modem_key_mgmt_write(rec.sec_tag, rec.cred_type, rec.content, rec.len);
+}
 
-    enum modem_key_mgnt_cred_type cred_type = *(u8_t*)*addr;
-    *addr += sizeof(enum modem_key_mgnt_cred_type);
+static int at_socket_send(int fd, const void *data, size_t len)
+{
+    ssize_t ret = send(fd, data, len, 0);
 
-    u16_t len = *(u16_t*)*addr;
-    *addr += sizeof(u16_t);
+    return (ret < 0 || (size_t)ret != len) ? -EIO : 0;
+}
+
+static int at_socket_result(int fd)
+{
+    char buf[64];
+    ssize_t ret;
+
+    ret = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (ret <= 0)
+    {
+        return -EIO;
+    }
+    buf[ret] = '\0';
+
+    if (0 == strncmp(buf, AT_RESPONSE_OK, strlen(AT_RESPONSE_OK)))
+    {
+        return 0;
+    }
+    if (0 == strncmp(buf, AT_RESPONSE_CME, strlen(AT_RESPONSE_CME)))
+    {
+        return atoi(buf + strlen(AT_RESPONSE_CME));
+    }
+    return -ENOEXEC;
+}
+
+static int at_socket_cmd(int fd, const char *cmd, size_t len)
+{
+    int ret = at_socket_send(fd, cmd, len);
+
+    return ret ? ret : at_socket_result(fd);
+}
+
+static int write_cmng_cmd(int fd, const struct cred_record *rec)
+{
+    /* The AT socket treats every send() as a complete command so the prefix, the
+     * flash-resident content, and the suffix are copied into one reusable buffer.
+     */
+    static char cmd_buf[CMNG_PREFIX_MAX_LEN + MAX_CRED_LEN + sizeof(CMNG_WRITE_SUFFIX)];
+    int len;
+
+    if (rec->len > MAX_CRED_LEN)
+    {
+        return -EMSGSIZE;
+    }
+
+    len = snprintf(cmd_buf, CMNG_PREFIX_MAX_LEN, CMNG_WRITE_PREFIX, rec->sec_tag, rec->cred_type);
+    memcpy(&cmd_buf[len], rec->content, rec->len);
+    len += rec->len;
+    memcpy(&cmd_buf[len], CMNG_WRITE_SUFFIX, strlen(CMNG_WRITE_SUFFIX));
+    len += strlen(CMNG_WRITE_SUFFIX);
 
-    ret = modem_key_mgmt_write(sec_tag, cred_type, (u8_t*)*addr, len);
+    return at_socket_cmd(fd, cmd_buf, len);
+}
 
-    *addr += len;
+static int send_content(int fd, const u8_t *content, u16_t len)
+{
+    /* Every placeholder is sent as the IMEI in flash, so the content is sent in runs from
+     * where it is instead of being expanded into a buffer first.
+     */
+    const u16_t placeholder_len = strlen(IMEI_PLACEHOLDER);
+    u16_t run = 0;
+    u16_t i = 0;
+    int ret = 0;
 
+    while (!ret && i < len)
+    {
+        if (i + placeholder_len <= len &&
+            0 == memcmp(&content[i], IMEI_PLACEHOLDER, placeholder_len))
+        {
+            ret = (i > run) ? at_socket_send(fd, &content[run], i - run) : 0;
+            if (!ret)
+            {
+                ret = at_socket_send(fd, (const u8_t *)IMEI_ADDR, IMEI_LEN);
+            }
+            i += placeholder_len;
+            run = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    if (!ret && len > run)
+    {
+        ret = at_socket_send(fd, &content[run], len - run);
+    }
     return ret;
 }
 
-static bool write_credentials(void)
+static int write_fragmented_cmng_cmd(int fd, const struct cred_record *rec)
 {
-    /* Ensure that the credentials haven't already been written. */
-    int fw_result_code = *(int*)FW_RESULT_CODE_ADDR;
-    if (BLANK_FW_RESULT != fw_result_code)
+    /* Only answered once the suffix closes the command, if the modem accepts a command over
+     * several sends at all. See MODE_WRITE_FRAGMENTED.
+     */
+    char prefix[CMNG_PREFIX_MAX_LEN];
+    int len;
+    int ret;
+
+    len = snprintf(prefix, sizeof(prefix), CMNG_WRITE_PREFIX, rec->sec_tag, rec->cred_type);
+    ret = at_socket_send(fd, prefix, len);
+    if (!ret)
+    {
+        ret = send_content(fd, rec->content, rec->len);
+    }
+    if (!ret)
+    {
+        ret = at_socket_send(fd, CMNG_WRITE_SUFFIX, strlen(CMNG_WRITE_SUFFIX));
+    }
+    return ret ? ret : at_socket_result(fd);
+}
+
+static int count_credentials(u32_t end)
+{
+    u32_t addr = FIRST_CRED_ADDR;
+    int count = 0;
+
+    while (addr < end)
+    {
+        if (end - addr < RECORD_HEADER_LEN)
+        {
+            return -EBADMSG;
+        }
+
+        u16_t len = *(u16_t*)(addr + RECORD_HEADER_LEN - sizeof(u16_t));
+        if (end - addr - RECORD_HEADER_LEN < len)
+        {
+            return -EBADMSG;
+        }
+
+        addr += RECORD_HEADER_LEN + len;
+        count++;
+    }
+
+    return count;
+}
+
+static int write_batched_credentials(u32_t * addr, u32_t end, bool fragmented)
+{
+    struct cred_record rec;
+    int fd;
+    int ret;
+
+    fd = socket(AF_LTE, 0, NPROTO_AT);
+    if (fd < 0)
+    {
+        printk("Failed to open AT socket: %d.\n", errno);
+        return -errno;
+    }
+
+    /* Enable extended error codes once instead of around every command. */
+    ret = at_socket_cmd(fd, "AT+CMEE=1", strlen("AT+CMEE=1"));
+
+    while (!ret && *addr < end)
+    {
+        parse_credential(addr, &rec);
+        if (fragmented)
+        {
+            ret = write_fragmented_cmng_cmd(fd, &rec);
+        }
+        else
+        {
+            ret = expand_imei(&rec);
+            if (!ret)
+            {
+                ret = write_cmng_cmd(fd, &rec);
+            }
+        }
+        if (!ret)
+        {
+            mailbox.cred_written++;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+static bool write_credentials(u8_t mode)
+{
+    bool batched = (MODE_WRITE != mode);
+    u32_t start;
+    int ret = 0;
+
+    if (!fw_result_blank())
     {
-        printk("Exiting because fw_result_code has already been written: %d.\n", fw_result_code);
         return false;
     }
 
     /* Ensure that there are credentials to write. */
-    u8_t cred_count = *(u8_t *)CRED_COUNT_ADDR;
-    printk("cred_count is %d.\n", cred_count);
-    if (ERROR_CRED_COUNT == cred_count)
+    u32_t records_len = *(u32_t *)RECORDS_LEN_ADDR;
+    if (BLANK_RECORDS_LEN == records_len)
     {
         printk("Exiting because there are no credentials to write.\n");
         return false;
     }
 
+    u32_t end = FIRST_CRED_ADDR + records_len;
+    int cred_count = (records_len <= FLASH_END_ADDR - FIRST_CRED_ADDR) ?
+        count_credentials(end) : -EBADMSG;
+    if (cred_count < 0)
+    {
+        printk("Exiting because the credential records are malformed.\n");
+        write_fw_result(cred_count);
+        return false;
+    }
+    printk("cred_count is %d (%u bytes).\n", cred_count, records_len);
+
     /* Write the credentials. */
+    start = k_uptime_get_32();
     u32_t addr = FIRST_CRED_ADDR;
-    for (u32_t i=0; i < cred_count; i++)
+    if (batched)
     {
-        int ret = parse_and_write_credential(&addr);
-        if (ret)
+        ret = write_batched_credentials(&addr, end, MODE_WRITE_FRAGMENTED == mode);
+    }
+    else
+    {
+        while (!ret && addr < end)
         {
-            printk("Exiting because credential write failed.\n");
-            write_fw_result(ret);
-            return false;
+            ret = parse_and_write_credential(&addr);
+            if (!ret)
+            {
+                mailbox.cred_written++;
+            }
         }
     }
-    printk("Credentials written.\n");
+    mailbox.cred_ms = k_uptime_get_32() - start;
+    mailbox.cred_batched = batched;
+
+    if (ret)
+    {
+        printk("Exiting because credential write failed.\n");
+        write_fw_result(ret);
+        return false;
+    }
+    printk("Credentials written in %u ms.\n", mailbox.cred_ms);
+
+    /* Record the results in flash. The digest must land before the result code. */
+    write_word(CRED_DIGEST_ADDR, crc32_ieee((u8_t*)FIRST_CRED_ADDR, addr - FIRST_CRED_ADDR));
+    write_fw_result(0x00);
+    return true;
+}
+
+static void channel_init(void)
+{
+    static u8_t up_buf[CHANNEL_UP_SIZE];
+    static u8_t down_buf[CHANNEL_DOWN_SIZE];
+
+    channel.max_up = 1;
+    channel.max_down = 1;
+    channel.up.name = (u32_t)"cred";
+    channel.up.buf = (u32_t)up_buf;
+    channel.up.size = sizeof(up_buf);
+    channel.down.name = (u32_t)"cred";
+    channel.down.buf = (u32_t)down_buf;
+    channel.down.size = sizeof(down_buf);
+    __DMB();
+    memcpy(channel.id, CHANNEL_ID, sizeof(CHANNEL_ID));
+}
+
+static u32_t ring_write(struct ring *ring, const u8_t *data, u32_t len)
+{
+    u32_t wr_off = ring->wr_off;
+    u32_t count = 0;
+
+    /* One byte is always left free so that a full ring can be told apart from an empty one. */
+    while (count < len && ((wr_off + 1) % ring->size) != ring->rd_off)
+    {
+        ((u8_t *)ring->buf)[wr_off] = data[count++];
+        wr_off = (wr_off + 1) % ring->size;
+    }
+    __DMB();
+    ring->wr_off = wr_off;
+    return count;
+}
+
+static u32_t ring_read(struct ring *ring, u8_t *data, u32_t len)
+{
+    u32_t rd_off = ring->rd_off;
+    u32_t count = 0;
+
+    while (count < len && rd_off != ring->wr_off)
+    {
+        data[count++] = ((u8_t *)ring->buf)[rd_off];
+        rd_off = (rd_off + 1) % ring->size;
+    }
+    __DMB();
+    ring->rd_off = rd_off;
+    return count;
+}
+
+static void channel_read(struct ring *ring, u8_t *data, u32_t len)
+{
+    u32_t count = 0;
+
+    while (count < len)
+    {
+        count += ring_read(ring, &data[count], len - count);
+        if (count < len)
+        {
+            k_sleep(CHANNEL_POLL_MS);
+        }
+    }
+}
+
+static void channel_tx(const u8_t *data, u32_t len)
+{
+    u32_t count = 0;
+
+    /* Results are never dropped so wait for the host to make room. */
+    while (count < len)
+    {
+        count += ring_write(&channel.up, &data[count], len - count);
+        if (count < len)
+        {
+            k_sleep(CHANNEL_POLL_MS);
+        }
+    }
+}
+
+static void channel_send(const struct transport *transport, const char *fmt, ...)
+{
+    char line[CHANNEL_LINE_LEN];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    len = MIN(len, (int)sizeof(line) - 1);
+
+    transport->tx((const u8_t *)line, len);
+}
+
+static int channel_printk(int c)
+{
+    u8_t byte = c;
+
+    /* Log output is dropped rather than blocking when the host isn't reading it. */
+    ring_write(&channel.up, &byte, 1);
+    return c;
+}
+
+static void uart_isr(struct device *dev)
+{
+    u8_t byte;
+
+    uart_irq_update(dev);
+    while (uart_irq_rx_ready(dev) && 1 == uart_fifo_read(dev, &byte, 1))
+    {
+        /* The host keeps within the announced window so a full buffer only loses noise. */
+        ring_write(&uart_rx, &byte, 1);
+    }
+}
+
+static void uart_tx(const u8_t *data, u32_t len)
+{
+    for (u32_t i = 0; i < len; i++)
+    {
+        uart_poll_out(uart_dev, data[i]);
+    }
+}
+
+static int uart_init(void)
+{
+    static u8_t rx_buf[UART_RX_SIZE];
+    struct uart_config config;
+    int ret;
+
+    uart_dev = device_get_binding(UART_DEV_NAME);
+    if (!uart_dev)
+    {
+        return -ENODEV;
+    }
+
+    ret = uart_config_get(uart_dev, &config);
+    if (!ret)
+    {
+        config.baudrate = UART_BAUDRATE;
+        ret = uart_configure(uart_dev, &config);
+    }
+    if (ret)
+    {
+        return ret;
+    }
+
+    uart_rx.buf = (u32_t)rx_buf;
+    uart_rx.size = sizeof(rx_buf);
+
+    /* The AT host library's handler is replaced for the rest of the run. */
+    uart_irq_rx_disable(uart_dev);
+    uart_irq_callback_set(uart_dev, uart_isr);
+    uart_irq_rx_enable(uart_dev);
+    return 0;
+}
+
+static bool receive_credentials(const struct transport *transport)
+{
+    static u8_t content[MAX_CRED_LEN];
+    struct cred_record rec;
+    u8_t header[RECORD_HEADER_LEN];
+    u8_t frame_crc[sizeof(u32_t)];
+    u16_t frame_len;
+    u32_t sec_tag;
+    u8_t  cred_type;
+    u16_t len;
+    u32_t crc = 0;
+    u32_t count = 0;
+    u32_t start;
+    int result = 0;
+    int ret;
+
+    start = k_uptime_get_32();
+    while (true)
+    {
+        if (transport->framed)
+        {
+            channel_read(transport->rx, (u8_t *)&frame_len, sizeof(frame_len));
+        }
+        channel_read(transport->rx, header, sizeof(header));
+        memcpy(&sec_tag, &header[0], sizeof(sec_tag));
+        cred_type = header[sizeof(sec_tag)];
+        memcpy(&len, &header[sizeof(sec_tag) + sizeof(cred_type)], sizeof(len));
+        if (transport->framed && frame_len != RECORD_HEADER_LEN + len)
+        {
+            /* The frame boundaries can't be trusted any more so give up on the stream. */
+            result = -EBADMSG;
+            break;
+        }
+        if (STREAM_END_SEC_TAG == sec_tag)
+        {
+            break;
+        }
+        if (len > MAX_CRED_LEN)
+        {
+            /* There's no way to find the next record so give up on the stream. */
+            result = -EMSGSIZE;
+            break;
+        }
+
+        channel_read(transport->rx, content, len);
+        crc = crc32_ieee_update(crc, header, sizeof(header));
+        crc = crc32_ieee_update(crc, content, len);
+
+        ret = 0;
+        if (transport->framed)
+        {
+            u32_t expected;
+
+            channel_read(transport->rx, frame_crc, sizeof(frame_crc));
+            memcpy(&expected, frame_crc, sizeof(expected));
+            if (expected != crc32_ieee_update(crc32_ieee(header, sizeof(header)), content, len))
+            {
+                ret = -EBADMSG;
+            }
+        }
+        if (!ret)
+        {
+            rec.sec_tag = sec_tag;
+            rec.cred_type = cred_type;
+            rec.content = content;
+            rec.len = len;
+            ret = expand_imei(&rec);
+        }
+        if (!ret)
+        {
+            ret = modem_key_mgmt_write(rec.sec_tag, rec.cred_type, rec.content, rec.len);
+        }
+        channel_send(transport, "%%CRED: %u,%d\n", count, ret);
+        if (!ret)
+        {
+            mailbox.cred_written++;
+        }
+        else if (!result)
+        {
+            result = ret;
+        }
+        count++;
+    }
+    mailbox.cred_ms = k_uptime_get_32() - start;
+    printk("%u credentials streamed in %u ms.\n", count, mailbox.cred_ms);
+
+    channel_send(transport, "%%DONE: %d,%u,%u\n", result, count, crc);
+    write_fw_result(result);
+    return !result;
+}
+
+static bool stream_credentials(void)
+{
+    static const struct transport transport = { &channel.down, channel_tx, false };
+
+    if (!fw_result_blank())
+    {
+        return false;
+    }
+
+    channel_init();
+    __printk_hook_install(channel_printk);
+    mailbox.channel_addr = (u32_t)&channel;
+
+    return receive_credentials(&transport);
+}
+
+static bool uart_credentials(void)
+{
+    static const struct transport transport = { &uart_rx, uart_tx, true };
+    int ret;
+
+    if (!fw_result_blank())
+    {
+        return false;
+    }
+
+    ret = uart_init();
+    if (ret)
+    {
+        printk("Exiting because the UART couldn't be set up: %d.\n", ret);
+        write_fw_result(ret);
+        return false;
+    }
+
+    channel_send(&transport, "%%READY: %u\n", uart_rx.size - 1);
+    return receive_credentials(&transport);
+}
+
+static void hash_pages(void)
+{
+    /* Flash below the firmware belongs to the secure partition manager. */
+    u32_t start = (u32_t)_image_rom_start & ~(FLASH_PAGE_SIZE - 1);
+
+    /* The hashes follow the mode byte so they aren't word aligned. */
+    write_bytes(PAGE_HASHES_ADDR, &start, sizeof(start));
+    for (u32_t addr = start; addr < FLASH_END_ADDR; addr += FLASH_PAGE_SIZE)
+    {
+        u32_t hash = crc32_ieee((const u8_t *)addr, FLASH_PAGE_SIZE);
+
+        write_bytes(PAGE_HASHES_ADDR + sizeof(start) +
+                    ((addr - start) / FLASH_PAGE_SIZE) * sizeof(hash), &hash, sizeof(hash));
+    }
+    write_fw_result(0x00);
+}
+
+static bool keygen_credentials(void)
+{
+    static char keygen_buf[CONFIG_AT_CMD_RESPONSE_MAX_LEN];
+    enum at_cmd_state at_state;
+    char cmd[CMNG_PREFIX_MAX_LEN];
+    struct cred_record rec;
+    u32_t addr = FIRST_CRED_ADDR;
+    char *csr;
+    size_t len;
+    int ret;
+
+    if (!fw_result_blank())
+    {
+        return false;
+    }
+
+    if (RECORD_HEADER_LEN != *(u32_t *)RECORDS_LEN_ADDR)
+    {
+        printk("Exiting because the key request is malformed.\n");
+        write_fw_result(-EBADMSG);
+        return false;
+    }
+    parse_credential(&addr, &rec);
+
+    snprintf(cmd, sizeof(cmd), KEYGEN_CMD, rec.sec_tag, rec.cred_type);
+    ret = at_cmd_write(cmd, keygen_buf, sizeof(keygen_buf), &at_state);
+    csr = strstr(keygen_buf, KEYGEN_RESPONSE);
+    if (!ret && !csr)
+    {
+        ret = -EBADMSG;
+    }
+    if (ret)
+    {
+        printk("Exiting because key generation failed.\n");
+        write_fw_result(ret);
+        return false;
+    }
+
+    /* Only the CSR is kept, not the COSE object that follows it. */
+    csr += strlen(KEYGEN_RESPONSE);
+    len = strcspn(csr, ".\"");
+    csr[len] = '\0';
+    write_bytes(CSR_ADDR, csr, len + 1);
+    printk("CSR written (%u bytes).\n", len);
+
+    return stream_credentials();
+}
+
+static bool check_credentials(void)
+{
+    static char list_buf[CONFIG_AT_CMD_RESPONSE_MAX_LEN];
+    enum at_cmd_state at_state;
+    size_t len;
+    int ret;
+
+    if (!fw_result_blank())
+    {
+        return false;
+    }
+
+    ret = at_cmd_write("AT%CMNG=1", list_buf, sizeof(list_buf), &at_state);
+    if (ret)
+    {
+        printk("Exiting because listing credentials failed.\n");
+        write_fw_result(ret);
+        return false;
+    }
+
+    /* Keep the terminator so the host doesn't have to rely on erased flash. */
+    len = strnlen(list_buf, sizeof(list_buf) - 1);
+    list_buf[len] = '\0';
+    write_bytes(CHECK_LIST_ADDR, list_buf, len + 1);
+    printk("Credential list written (%u bytes).\n", len);
 
-    /* Record the results in flash. */
     write_fw_result(0x00);
     return true;
 }
@@ -175,20 +1091,41 @@ static bool write_credentials(void)
 void main(void)
 {
     int  ret;
-    u8_t result_buf[32];
+    char result_buf[32];
+    u8_t mode = *(u8_t *)MODE_ADDR;
 
     printk("cred started\n");
 
-    /* Power off the modem. */
-    ret = query_modem("AT+CFUN=0", result_buf, sizeof(result_buf));
-    if (ret)
+    /* Tell the host where to look for the mailbox. */
+    write_word(MAILBOX_ADDR_ADDR, (u32_t)&mailbox);
+    mailbox.boot_ms = k_uptime_get_32();
+    /* Only set once AT+CFUN? has been answered, which MODE_HASH and MODE_IMEI don't ask. */
+    mailbox.cfun_mode = CFUN_MODE_UNKNOWN;
+
+    if (MODE_HASH == mode)
     {
-        printk("ERROR: Failed to set CFUN_MODE_POWER_OFF.\n");
+        hash_pages();
+        printk("OK: Flash pages hashed.\n");
         goto finish;
     }
-    else
+
+    if (MODE_IMEI != mode)
     {
-        printk("Modem set to CFUN_MODE_POWER_OFF.\n");
+        /* Power off the modem. */
+        ret = power_off_modem(result_buf, sizeof(result_buf));
+        if (ret)
+        {
+            printk("ERROR: Failed to set CFUN_MODE_POWER_OFF.\n");
+            goto finish;
+        }
+        else if (mailbox.cfun_changed)
+        {
+            printk("Modem set to CFUN_MODE_POWER_OFF.\n");
+        }
+        else
+        {
+            printk("Modem already offline (CFUN=%d), left unchanged.\n", mailbox.cfun_mode);
+        }
     }
 
     ret = query_modem("AT+CGSN", result_buf, sizeof(result_buf));
@@ -202,6 +1139,13 @@ void main(void)
         printk("Modem IMEI read.\n");
     }
 
+    publish_imei(result_buf);
+    if (MODE_IMEI == mode)
+    {
+        printk("OK: IMEI published.\n");
+        goto finish;
+    }
+
     if (!write_imei(result_buf))
     {
         printk("ERROR: IMEI not written successfully.\n");
@@ -212,7 +1156,40 @@ void main(void)
         printk("IMEI written successfully.\n");
     }
 
-    if (write_credentials())
+    if (MODE_CHECK == mode)
+    {
+        if (check_credentials())
+        {
+            printk("OK: Credentials listed successfully.\n");
+        }
+        else
+        {
+            printk("ERROR: Credentials were not listed successfully.\n");
+        }
+    }
+    else if (MODE_KEYGEN == mode)
+    {
+        if (keygen_credentials())
+        {
+            printk("OK: Key generated and credentials streamed successfully.\n");
+        }
+        else
+        {
+            printk("ERROR: Key not generated or credentials not streamed successfully.\n");
+        }
+    }
+    else if (MODE_STREAM == mode || MODE_UART == mode)
+    {
+        if ((MODE_STREAM == mode) ? stream_credentials() : uart_credentials())
+        {
+            printk("OK: Credentials streamed successfully.\n");
+        }
+        else
+        {
+            printk("ERROR: Credentials were not streamed successfully.\n");
+        }
+    }
+    else if (write_credentials(mode))
     {
         printk("OK: Credentials written successfully.\n");
     }
@@ -222,6 +1199,11 @@ void main(void)
     }
 
 finish:
+    if (CoreDebug->DHCSR & CoreDebug_DHCSR_C_DEBUGEN_Msk)
+    {
+        __BKPT(0);
+    }
+
     while(true)
     {
         /* Loop forever. */